@@ -4,121 +4,358 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "aux.h"
+#include "collector.h"
+#include "config.h"
 #include "constants.h"
+#include "controller.h"
+#include "lane.h"
 #include "operations.h"
+#include "order.h"
 #include "parser.h"
+#include "stats.h"
+#include "trace.h"
 
 int check_line(int thread_id, int line, int max_threads) {
 	return line % max_threads == thread_id;
 }
 
-void *run_thread(void *thread_args) {
-	Args *args = (Args *)thread_args;
-	int line = 0;
-	while (1) {
-		unsigned int event_id, delay, thread_id;
-		size_t num_rows, num_columns, num_coords;
-		size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
-		fflush(stdout);
-		switch (get_next(args->fd_in, &line)) {
-		case CMD_CREATE:
-			if (parse_create(args->fd_in, &event_id, &num_rows, &num_columns) !=
-				0) {
-				fprintf(stderr, "Invalid command. See HELP for usage\n");
-				continue;
-			}
+/// Gets the seats of a reservation whose ranges are all single seats.
+/// @return Number of seats, 0 if any range spans several seats.
+static size_t single_seats(const struct SeatRange *ranges, size_t num_ranges,
+						   size_t *xs, size_t *ys) {
+	for (size_t i = 0; i < num_ranges; i++) {
+		if (ranges[i].first_row != ranges[i].last_row ||
+			ranges[i].first_col != ranges[i].last_col) {
+			return 0;
+		}
+		xs[i] = ranges[i].first_row;
+		ys[i] = ranges[i].first_col;
+	}
+	return num_ranges;
+}
 
-			if (!check_line(args->thread_id, line, args->max_threads)) {
-				break;
-			}
+/// Reads the reservations of a BATCH or TXN up to its END.
+/// @return 0 if the batch was parsed successfully, 1 otherwise.
+static int read_batch(int fd, struct Request *req) {
+	if (req->batch == NULL) {
+		req->batch = malloc(sizeof(struct Batch));
+		if (req->batch == NULL) {
+			fprintf(stderr, "Error allocating memory for batch\n");
+			return 1;
+		}
+	}
+	if (reserve_buffers(req) != 0) {
+		return 1;
+	}
 
-			if (ems_create(event_id, num_rows, num_columns)) {
-				fprintf(stderr, "Failed to create event\n");
-			}
-			break;
-		case CMD_RESERVE:
-			num_coords = parse_reserve(args->fd_in, MAX_RESERVATION_SIZE,
-									   &event_id, xs, ys);
-			if (num_coords == 0) {
-				fprintf(stderr, "Invalid command. See HELP for usage\n");
-				continue;
-			}
+	struct Batch *batch = req->batch;
+	batch->num_reservations = 0;
+	batch->num_seats = 0;
 
-			if (!check_line(args->thread_id, line, args->max_threads)) {
+	// The lines of a batch count as a single command.
+	int batch_line = 0;
+	int invalid = 0;
+	while (1) {
+		enum Command cmd = get_next(fd, &batch_line);
+		switch (cmd) {
+		case CMD_END:
+			return invalid;
+		case EOC:
+			return 1;
+		case CMD_EMPTY:
+			break;
+		case CMD_RESERVE: {
+			size_t free_seats = MAX_BATCH_SEATS - batch->num_seats;
+			size_t max_seats = config_get()->max_reservation;
+			size_t *xs = &batch->xs[batch->num_seats];
+			size_t *ys = &batch->ys[batch->num_seats];
+			unsigned int event_id;
+			// Blocks of seats are only reserved by plain RESERVEs.
+			size_t num_ranges = parse_reserve(
+				fd,
+				free_seats < max_seats ? free_seats : max_seats,
+				&event_id, req->ranges);
+			size_t num_seats = single_seats(req->ranges, num_ranges, xs, ys);
+			if (num_seats == 0 || batch->num_reservations == MAX_BATCH_SIZE) {
+				invalid = 1;
 				break;
 			}
-
-			if (ems_reserve(event_id, num_coords, xs, ys)) {
-				fprintf(stderr, "Failed to reserve seats\n");
-			}
+			batch->reservations[batch->num_reservations++] =
+				(struct Reservation){event_id, num_seats, xs, ys};
+			batch->num_seats += num_seats;
 			break;
+		}
+		case CMD_CREATE:
+		case CMD_CANCEL:
+		case CMD_DELETE:
 		case CMD_SHOW:
-			if (parse_show(args->fd_in, &event_id) != 0) {
-				fprintf(stderr, "Invalid command. See HELP for usage\n");
-				continue;
-			}
-
-			if (!check_line(args->thread_id, line, args->max_threads)) {
-				break;
-			}
-
-			if (ems_show(event_id, args->fd_out)) {
-				fprintf(stderr, "Failed to show event\n");
-			}
+		case CMD_WAIT:
+			skip_line(fd);
+			invalid = 1;
 			break;
 		case CMD_LIST_EVENTS:
-			if (!check_line(args->thread_id, line, args->max_threads)) {
-				break;
-			}
-			if (ems_list_events(args->fd_out)) {
-				fprintf(stderr, "Failed to list events\n");
-			}
+		case CMD_BARRIER:
+		case CMD_BATCH:
+		case CMD_TXN:
+		case CMD_HELP:
+		case CMD_INVALID:
+			invalid = 1;
+			break;
+		}
+	}
+}
 
+enum Command read_request(int fd, int *line, struct Request *req) {
+	int invalid = 0;
+	req->cmd = get_next(fd, line);
+	switch (req->cmd) {
+	case CMD_CREATE:
+		invalid =
+			parse_create(fd, &req->event_id, &req->num_rows, &req->num_cols) != 0;
+		break;
+	case CMD_RESERVE:
+		if (reserve_buffers(req) != 0) {
+			skip_line(fd);
+			invalid = 1;
 			break;
+		}
+		req->num_ranges = parse_reserve(fd, config_get()->max_reservation,
+										&req->event_id, req->ranges);
+		req->num_coords =
+			single_seats(req->ranges, req->num_ranges, req->xs, req->ys);
+		invalid = req->num_ranges == 0;
+		break;
+	case CMD_CANCEL:
+		invalid =
+			parse_cancel(fd, &req->event_id, &req->reservation_id) != 0;
+		break;
+	case CMD_DELETE:
+		invalid = parse_delete(fd, &req->event_id) != 0;
+		break;
+	case CMD_SHOW:
+		invalid = parse_show(fd, &req->event_id) != 0;
+		break;
+	case CMD_WAIT:
+		req->thread_id = 0;
+		invalid = parse_wait(fd, &req->delay, &req->thread_id) == -1;
+		break;
+	case CMD_BATCH:
+	case CMD_TXN:
+		invalid = read_batch(fd, req) != 0;
+		break;
+	case CMD_END: // Only valid at the end of a batch
+		invalid = 1;
+		break;
+	case CMD_LIST_EVENTS:
+	case CMD_BARRIER:
+	case CMD_HELP:
+	case CMD_EMPTY:
+	case CMD_INVALID:
+	case EOC:
+		break;
+	}
+
+	if (invalid) {
+		req->cmd = CMD_INVALID;
+	}
+	return req->cmd;
+}
+
+int reserve_buffers(struct Request *req) {
+	if (req->ranges != NULL) {
+		return 0;
+	}
+
+	size_t max_seats = config_get()->max_reservation;
+	req->xs = malloc(max_seats * sizeof(size_t));
+	req->ys = malloc(max_seats * sizeof(size_t));
+	req->ranges = malloc(max_seats * sizeof(struct SeatRange));
+	if (req->xs == NULL || req->ys == NULL || req->ranges == NULL) {
+		fprintf(stderr, "Error allocating memory for reservation\n");
+		free_request(req);
+		return 1;
+	}
+	return 0;
+}
+
+void free_request(struct Request *req) {
+	free(req->batch);
+	req->batch = NULL;
+	free(req->xs);
+	free(req->ys);
+	free(req->ranges);
+	req->xs = NULL;
+	req->ys = NULL;
+	req->ranges = NULL;
+}
+
+int execute_request(const struct Request *req, int fd_out) {
+	switch (req->cmd) {
+	case CMD_CREATE:
+		if (ems_create(req->event_id, req->num_rows, req->num_cols)) {
+			fprintf(stderr, "Failed to create event\n");
+			return 1;
+		}
+		return 0;
+	case CMD_RESERVE:
+		if (req->num_coords > 0
+				? ems_reserve(req->event_id, req->num_coords, req->xs, req->ys)
+				: ems_reserve_ranges(req->event_id, req->num_ranges,
+									 req->ranges)) {
+			fprintf(stderr, "Failed to reserve seats\n");
+			return 1;
+		}
+		return 0;
+	case CMD_CANCEL:
+		if (ems_cancel(req->event_id, req->reservation_id)) {
+			fprintf(stderr, "Failed to cancel reservation\n");
+			return 1;
+		}
+		return 0;
+	case CMD_DELETE:
+		if (ems_delete(req->event_id)) {
+			fprintf(stderr, "Failed to delete event\n");
+			return 1;
+		}
+		return 0;
+	case CMD_BATCH: {
+		size_t failed =
+			ems_reserve_batch(req->batch->num_reservations,
+							  req->batch->reservations, req->batch->results);
+		if (failed > 0) {
+			fprintf(stderr, "Failed to reserve seats of %zu batch entries\n",
+					failed);
+			return 1;
+		}
+		return 0;
+	}
+	case CMD_TXN:
+		if (ems_reserve_txn(req->batch->num_reservations,
+							req->batch->reservations)) {
+			fprintf(stderr, "Failed to reserve seats of transaction\n");
+			return 1;
+		}
+		return 0;
+	case CMD_SHOW:
+		if (ems_show(req->event_id, fd_out)) {
+			fprintf(stderr, "Failed to show event\n");
+			return 1;
+		}
+		return 0;
+	case CMD_LIST_EVENTS:
+		if (ems_list_events(fd_out)) {
+			fprintf(stderr, "Failed to list events\n");
+			return 1;
+		}
+		return 0;
+	case CMD_WAIT:
+		if (req->delay > 0) {
+			ems_wait(req->delay);
+		}
+		return 0;
+	case CMD_INVALID:
+		fprintf(stderr, "Invalid command. See HELP for usage\n");
+		return 1;
+	case CMD_HELP:
+		printf(HELP_TEXT);
+		return 0;
+	case CMD_BARRIER:
+	case CMD_END:
+	case CMD_EMPTY:
+	case EOC:
+		return 0;
+	}
+	return 0;
+}
+
+void execute_collected(const struct Request *req, int line, int fd_out,
+					   struct OutputCollector *collector) {
+	output_capture_begin();
+	execute_request(req, fd_out);
+	size_t len;
+	char *output = output_capture_end(&len);
+	if (len == 0) {
+		free(output);
+		output = NULL;
+	}
+	collector_submit(collector, line, output, len);
+}
+
+void *run_thread(void *thread_args) {
+	Args *args = (Args *)thread_args;
+	int line = 0;
+	struct Request req = {0};
+	struct LineHistory history = {0};
+	STATS_SET_THREAD(args->thread_id);
+	TRACE_THREAD(args->thread_id);
+	while (1) {
+		fflush(stdout);
+		STATS_START(start);
+		TRACE_START(trace_start);
+		enum Command cmd = read_request(args->fd_in, &line, &req);
+		STATS_SET_CONTEXT(cmd, line);
+		int owned = check_line(args->thread_id, line, args->max_threads);
+		switch (cmd) {
 		case CMD_WAIT:
-			if (parse_wait(args->fd_in, &delay, &thread_id) == -1) {
-				fprintf(stderr, "Invalid command. See HELP for usage\n");
-				continue;
-			}
-			if (delay > 0 &&
-				((int)thread_id == args->thread_id + 1 || thread_id == 0)) {
+			if (req.delay > 0 && ((int)req.thread_id == args->thread_id + 1 ||
+								  req.thread_id == 0)) {
 				printf("Waiting...\n");
-				ems_wait(delay);
-			}
-			break;
-		case CMD_INVALID:
-			if (!check_line(args->thread_id, line, args->max_threads)) {
-				break;
+				ems_wait(req.delay);
 			}
-
-			fprintf(stderr, "Invalid command. See HELP for usage\n");
-			break;
-		case CMD_HELP:
-			if (!check_line(args->thread_id, line, args->max_threads)) {
-				break;
+			if (owned) {
+				collector_submit(args->collector, line, NULL, 0);
 			}
-
-			printf("Available commands:\n"
-				   "  CREATE <event_id> <num_rows> <num_columns>\n"
-				   "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"
-				   "  SHOW <event_id>\n"
-				   "  LIST\n"
-				   "  WAIT <delay_ms> [thread_id]\n"
-				   "  BARRIER\n"
-				   "  HELP\n");
 			break;
 		case CMD_BARRIER:
+			TRACE_BARRIER_ARRIVE();
+			free_request(&req);
+			history_free(&history);
+			args->lines = line;
 			pthread_exit(BARRIER);
-		case CMD_EMPTY:
-
-			break;
 		case EOC:
 			close(args->fd_in);
+			free_request(&req);
+			history_free(&history);
 			pthread_exit(SUCESS);
+		case CMD_CREATE:
+		case CMD_RESERVE:
+		case CMD_CANCEL:
+		case CMD_DELETE:
+		case CMD_BATCH:
+		case CMD_TXN:
+		case CMD_END:
+		case CMD_SHOW:
+		case CMD_LIST_EVENTS:
+		case CMD_INVALID:
+		case CMD_HELP:
+		case CMD_EMPTY:
+			if (args->order != NULL) {
+				order_wait(args->order, &history, &req, line, owned);
+			}
+			if (!owned) {
+				break;
+			}
+			// The lane records the latency of the reads it runs.
+			if (args->lane != NULL && lane_is_read(cmd) &&
+				lane_defer(args->lane, &req, line) == 0) {
+				owned = 0;
+			} else {
+				if (args->lane != NULL) {
+					lane_order(args->lane, &req);
+				}
+				execute_collected(&req, line, args->fd_out, args->collector);
+			}
+			if (args->order != NULL) {
+				order_done(args->order, args->thread_id, line);
+			}
+			break;
 		}
+		STATS_RECORD_COMMAND(cmd, owned, start);
+		TRACE_COMPLETE(owned ? command_name(cmd) : "parse", trace_start, line);
 	}
 	close(args->fd_in);
 	pthread_exit(SUCESS);
@@ -134,21 +371,97 @@ int create_output_file(char *filename, char *dirname) {
 	return open(final, O_CREAT | O_RDWR | O_TRUNC, 0666);
 }
 
+/// Changes the number of threads reading a job file between two stretches.
+/// The new threads read on from where the others stopped.
+/// @note No thread may be running.
+/// @return The number of threads now set up.
+static int resize_threads(Args *args_list, int num_threads, int new_threads,
+						  char *filein) {
+	off_t offset = lseek(args_list[0].fd_in, 0, SEEK_CUR);
+	int i = num_threads;
+	for (; i < new_threads; i++) {
+		args_list[i] = args_list[0];
+		args_list[i].thread_id = i;
+		args_list[i].fd_in = open(filein, O_RDONLY);
+		if (args_list[i].fd_in < 0 ||
+			lseek(args_list[i].fd_in, offset, SEEK_SET) != offset) {
+			fprintf(stderr, "Failed to open %s: %s\n", filein, strerror(errno));
+			if (args_list[i].fd_in >= 0) {
+				close(args_list[i].fd_in);
+			}
+			break;
+		}
+	}
+	for (int j = new_threads; j < num_threads; j++) {
+		close(args_list[j].fd_in);
+	}
+
+	num_threads = i < new_threads ? i : new_threads;
+	for (int j = 0; j < num_threads; j++) {
+		args_list[j].max_threads = num_threads;
+	}
+	return num_threads;
+}
+
 int execute_file(char *filein, int fd_out, unsigned int state_access_delay_ms,
-				 int max_threads) {
+				 int max_threads, int adaptive_max_threads) {
 	if (ems_init(state_access_delay_ms)) {
 		fprintf(stderr, "Failed to initialize EMS\n");
 		return 1;
 	}
 
-	pthread_t *threads = malloc((unsigned long)max_threads * sizeof(pthread_t));
-	Args *args_list = malloc((unsigned long)max_threads * sizeof(Args));
+	struct OutputCollector *collector = collector_create(fd_out);
+	if (collector == NULL) {
+		ems_terminate();
+		return 1;
+	}
+
+	struct ThreadController controller;
+	int capacity = max_threads;
+	if (adaptive_max_threads > 0) {
+		controller_init(&controller, adaptive_max_threads);
+		max_threads = controller.threads;
+		capacity = adaptive_max_threads;
+	}
+
+	struct ReadLane *lane = NULL;
+	if (config_get()->priority) {
+		// Numbered after the threads, so that their stats stay apart.
+		lane = lane_create(collector, fd_out,
+						   (unsigned int)config_get()->read_deadline, capacity);
+		if (lane == NULL) {
+			collector_destroy(collector);
+			ems_terminate();
+			return 1;
+		}
+	}
+
+	struct LineOrder *order = NULL;
+	if (capacity > 1) {
+		order = order_create(capacity);
+		if (order == NULL) {
+			if (lane != NULL) {
+				lane_destroy(lane);
+			}
+			collector_destroy(collector);
+			ems_terminate();
+			return 1;
+		}
+		order_reset(order, max_threads);
+	}
+
+	pthread_t *threads = malloc((unsigned long)capacity * sizeof(pthread_t));
+	Args *args_list = malloc((unsigned long)capacity * sizeof(Args));
 	for (int i = 0; i < max_threads; i++) {
 		int fd_in = open(filein, O_RDONLY);
 		args_list[i].fd_in = fd_in;
 		args_list[i].fd_out = fd_out;
+		args_list[i].collector = collector;
+		args_list[i].lane = lane;
+		args_list[i].order = order;
 		args_list[i].max_threads = max_threads;
 		args_list[i].thread_id = i;
+		args_list[i].lines = 0;
 		pthread_create(&threads[i], NULL, run_thread, (void *)&args_list[i]);
 	}
 
@@ -161,8 +474,26 @@ int execute_file(char *filein, int fd_out, unsigned int state_access_delay_ms,
 				is_barrier = 1;
 			}
 		}
+		// Every line before the BARRIER or the end of the file was executed.
+		if (lane != NULL) {
+			lane_drain(lane);
+		}
+		collector_flush(collector);
 		if (is_barrier) {
 			is_barrier = 0;
+			TRACE_BARRIER_RELEASE();
+			if (adaptive_max_threads > 0) {
+				// Every thread read the whole stretch.
+				int next = controller_next(&controller, (size_t)args_list[0].lines);
+				if (next != max_threads) {
+					max_threads =
+						resize_threads(args_list, max_threads, next, filein);
+				}
+				controller_start(&controller);
+			}
+			if (order != NULL) {
+				order_reset(order, max_threads);
+			}
 			for (int i = 0; i < max_threads; i++) {
 				pthread_create(&threads[i], NULL, run_thread,
 							   (void *)&args_list[i]);
@@ -172,14 +503,105 @@ int execute_file(char *filein, int fd_out, unsigned int state_access_delay_ms,
 		}
 	}
 
+	if (lane != NULL) {
+		lane_destroy(lane);
+	}
+	if (order != NULL) {
+		order_destroy(order);
+	}
 	ems_terminate();
+	STATS_DUMP(filein);
+	TRACE_FLUSH_JOB(filein);
+	collector_destroy(collector);
 	free(args_list);
 	free(threads);
 	return 0;
 }
+/// Output captured by the calling thread, see output_capture_begin.
+struct Capture {
+	int active;
+	int failed;
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+static _Thread_local struct Capture capture = {0};
+
+void output_capture_begin(void) {
+	capture = (struct Capture){.active = 1};
+}
+
+char *output_capture_end(size_t *len) {
+	char *data = capture.data;
+	if (capture.failed) {
+		free(data);
+		data = NULL;
+	} else if (data == NULL) {
+		data = calloc(1, 1);
+	}
+	*len = data == NULL ? 0 : capture.len;
+	capture = (struct Capture){0};
+	return data;
+}
+
+/// Appends to the captured output.
+static void capture_append(const char *string, size_t len) {
+	if (capture.failed) {
+		return;
+	}
+	if (capture.len + len + 1 > capture.capacity) {
+		size_t capacity = capture.capacity ? capture.capacity : 256;
+		while (capture.len + len + 1 > capacity) {
+			capacity *= 2;
+		}
+		char *data = realloc(capture.data, capacity);
+		if (data == NULL) {
+			fprintf(stderr, "Error allocating memory for output\n");
+			capture.failed = 1;
+			return;
+		}
+		capture.data = data;
+		capture.capacity = capacity;
+	}
+	memcpy(capture.data + capture.len, string, len);
+	capture.len += len;
+	capture.data[capture.len] = '\0';
+}
+
 void mywrite(int fd, char *string) {
 	size_t len = strlen(string);
+	if (capture.active) {
+		capture_append(string, len);
+		return;
+	}
+	STATS_START(start);
 	if (write(fd, string, len) < 0) {
 		fprintf(stderr, "write error: %s\n", strerror(errno));
 	}
-}
\ No newline at end of file
+	STATS_RECORD(STATS_WRITE, start);
+}
+
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return 1;
+		}
+
+		size_t written = (size_t)n;
+		while (iovcnt > 0 && written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
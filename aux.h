@@ -5,12 +5,72 @@
 #define SUCESS (void *)0
 
 #include <pthread.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+
+#define HELP_TEXT                                                              \
+  "Available commands:\n"                                                      \
+  "  CREATE <event_id> <num_rows> <num_columns>\n"                             \
+  "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"                       \
+  "  RESERVE <event_id> [(<x1>..<x2>,<y1>..<y2>) ...]\n"                       \
+  "  CANCEL <event_id> <reservation_id>\n"                                     \
+  "  DELETE <event_id>\n"                                                      \
+  "  SHOW <event_id>\n"                                                        \
+  "  LIST\n"                                                                   \
+  "  WAIT <delay_ms> [thread_id]\n"                                            \
+  "  BARRIER\n"                                                                \
+  "  BATCH | TXN\n"                                                            \
+  "    RESERVE ... (one per line)\n"                                           \
+  "  END\n"                                                                    \
+  "  HELP\n"
+
+/// Reservations grouped by a BATCH or TXN ... END block.
+struct Batch {
+  size_t num_reservations;
+  struct Reservation reservations[MAX_BATCH_SIZE];
+  int results[MAX_BATCH_SIZE]; /// Result of every reservation once executed.
+  size_t num_seats;            /// Seats used in xs and ys.
+  size_t xs[MAX_BATCH_SEATS];
+  size_t ys[MAX_BATCH_SEATS];
+};
+
+/// A parsed command and its arguments.
+/// @note Must be zero-initialized before the first use and released with
+/// free_request.
+struct Request {
+  enum Command cmd; /// CMD_INVALID if the command could not be parsed.
+  unsigned int event_id;
+  unsigned int reservation_id; /// Reservation targeted by a CANCEL.
+  size_t num_rows;
+  size_t num_cols;
+  size_t num_coords; /// Seats of a RESERVE, 0 if it reserves blocks.
+  size_t *xs;        /// max_reservation seats, see reserve_buffers.
+  size_t *ys;
+  size_t num_ranges;        /// Seats and blocks of a RESERVE.
+  struct SeatRange *ranges; /// max_reservation seats and blocks.
+  unsigned int delay;
+  unsigned int thread_id; /// Thread targeted by a WAIT, 0 for every thread.
+  struct Batch *batch;    /// Reservations of a BATCH or TXN, reused.
+};
+
+struct LineOrder;
+struct OutputCollector;
+struct ReadLane;
 
 typedef struct args {
   int fd_in;
   int fd_out;
+  struct OutputCollector *collector; /// Writes the output in line order.
+  struct ReadLane *lane; /// Runs the SHOWs and LISTs, NULL to run them inline.
+  struct LineOrder *order; /// Orders the lines on the same events, NULL with a
+                           /// single thread.
   int thread_id;
   int max_threads;
+  int lines; /// Lines read up to the BARRIER the thread stopped at.
 } Args;
 
 /// Creates a output file for the given input file
@@ -18,14 +78,63 @@ typedef struct args {
 /// @return the file descriptor of the output file
 int create_output_file(char *filename, char *dirname);
 
+/// Reads and parses the next command.
+/// @param fd File descriptor to read from.
+/// @param line Line counter, incremented for every command read.
+/// @param req Request to store the command and its arguments in.
+/// @return The command read, CMD_INVALID if it could not be parsed.
+enum Command read_request(int fd, int *line, struct Request *req);
+
+/// Allocates the seats and blocks of a RESERVE, sized from max_reservation.
+/// @note Does nothing if they are already allocated.
+/// @return 0 on success, 1 on failure.
+int reserve_buffers(struct Request *req);
+
+/// Releases the memory held by a request.
+void free_request(struct Request *req);
+
+/// Executes a parsed command, reporting failures on stderr.
+/// @param req Request to execute.
+/// @param fd_out File descriptor to write the output of SHOW and LIST to.
+/// @note HELP is printed on stdout, streams and clients write it themselves.
+/// @return 0 if the command succeeded, 1 otherwise.
+int execute_request(const struct Request *req, int fd_out);
+
+/// Executes a parsed command and submits its output to a collector.
+/// @param line Line of the command.
+void execute_collected(const struct Request *req, int line, int fd_out,
+                       struct OutputCollector *collector);
+
 void *run_thread(void *thread_args);
 
 /// Executes the commands on an input file and executes the commands
+/// @note The commands touching the same events run in the order of their
+/// lines and the output is written in that order too, so it is the same
+/// whatever the number of threads.
 /// @param filein descriptor of the input file
 /// @param fd_out File descriptor of the output file
+/// @param adaptive_max_threads If not 0, the threads are picked at every
+/// BARRIER by a ThreadController, up to this many, and max_threads is
+/// ignored.
+/// @note With the priority setting, SHOW and LIST run on a ReadLane behind
+/// the writes, see lane.h.
 /// @return 0 if suceeds
 int execute_file(char *filein, int fd_out, unsigned int state_access_delay_ms,
-                 int max_threads);
+                 int max_threads, int adaptive_max_threads);
+
+/// Makes mywrite append the output of the calling thread to a buffer instead
+/// of writing it, until output_capture_end is called.
+void output_capture_begin(void);
+
+/// Stops capturing the output of the calling thread.
+/// @param len Pointer to the variable to store the length of the output in.
+/// @return The NUL-terminated output, to be freed by the caller. NULL on
+/// failure.
+char *output_capture_end(size_t *len);
+
+/// Writes every buffer of iov, retrying on partial writes.
+/// @return 0 on success, 1 on error.
+int writev_all(int fd, struct iovec *iov, int iovcnt);
 
 /// Write that handles all the arguments
 /// @param fd file descriptor of the output file
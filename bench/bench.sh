@@ -0,0 +1,81 @@
+#!/bin/sh
+# Runs ems over generated workloads for every combination of processes,
+# threads and delays, and reports throughput and p50/p99 command latency.
+#
+# Usage: bench/bench.sh [jobgen options...]
+# Environment:
+#   BENCH_FILES    Job files per run (default 4)
+#   BENCH_PROCS    Process counts to sweep (default "1 2 4")
+#   BENCH_THREADS  Thread counts to sweep (default "1 2 4 8")
+#   BENCH_DELAYS   State access delays to sweep, in ms (default "0 1")
+#   BENCH_SHARDS   Shard processes per job file to sweep, 0 to run every job
+#                  file in a single process (default "0")
+#   BENCH_OUT      Also append the results as CSV to this file
+
+set -e
+
+dir=$(dirname "$0")
+ems="$dir/ems"
+jobgen="$dir/jobgen"
+files=${BENCH_FILES:-4}
+procs=${BENCH_PROCS:-"1 2 4"}
+threads=${BENCH_THREADS:-"1 2 4 8"}
+delays=${BENCH_DELAYS:-"0 1"}
+shards=${BENCH_SHARDS:-0}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+i=1
+while [ "$i" -le "$files" ]; do
+  "$jobgen" -z "$i" "$@" > "$work/$i.jobs"
+  i=$((i + 1))
+done
+commands=$(cat "$work"/*.jobs | grep -c -v '^$')
+
+now_ns() {
+  date +%s%N
+}
+
+echo "workload: $files files, $commands commands, jobgen $*"
+printf "%6s %6s %8s %6s %10s %12s %12s %12s\n" \
+  shards procs threads delay time_ms cmds_per_s p50_us p99_us
+
+for s in $shards; do
+  for delay in $delays; do
+    for p in $procs; do
+      for t in $threads; do
+        rm -f "$work"/*.out "$work/stats"
+        sharding=""
+        if [ "$s" -gt 0 ]; then
+          sharding="-S $s"
+        fi
+        start=$(now_ns)
+        # shellcheck disable=SC2086
+        EMS_STATS=text EMS_STATS_FILE="$work/stats" \
+          "$ems" $sharding "$work" "$p" "$t" "$delay" > /dev/null 2>&1
+        end=$(now_ns)
+
+        # Worst p50/p99 over the job files of the run.
+        awk -v start="$start" -v end="$end" -v commands="$commands" \
+          -v s="$s" -v p="$p" -v t="$t" -v delay="$delay" -v out="$BENCH_OUT" '
+          /^  total / {
+            for (i = 2; i <= NF; i++) {
+              split($i, kv, "=")
+              if (kv[1] == "p50" && kv[2] > p50) p50 = kv[2]
+              if (kv[1] == "p99" && kv[2] > p99) p99 = kv[2]
+            }
+          }
+          END {
+            ms = (end - start) / 1e6
+            rate = ms > 0 ? commands * 1000 / ms : 0
+            printf "%6d %6d %8d %6d %10.1f %12.0f %12.1f %12.1f\n",
+              s, p, t, delay, ms, rate, p50 / 1e3, p99 / 1e3
+            if (out != "")
+              printf "%d,%d,%d,%d,%.1f,%.0f,%.1f,%.1f\n",
+                s, p, t, delay, ms, rate, p50 / 1e3, p99 / 1e3 >> out
+          }' "$work/stats"
+      done
+    done
+  done
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs ems over churn workloads of growing length, where events are deleted
+# and created again all the time, and reports the peak memory of each run.
+# With deleted events reclaimed, the peak stays flat as the workload grows.
+#
+# Usage: bench/churn.sh [jobgen options...]
+# Environment:
+#   CHURN_COMMANDS  Workload lengths to run (default "10000 40000 160000")
+#   CHURN_THREADS   Threads per run (default 4)
+
+set -e
+
+dir=$(dirname "$0")
+ems="$dir/ems"
+jobgen="$dir/jobgen"
+lengths=${CHURN_COMMANDS:-"10000 40000 160000"}
+threads=${CHURN_THREADS:-4}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+echo "churn workload: $threads threads, jobgen -u 20 $*"
+printf "%10s %10s %12s\n" commands time_ms max_rss_kb
+
+for n in $lengths; do
+  rm -f "$work"/*.jobs "$work"/*.out "$work/stats"
+  "$jobgen" -n "$n" -u 20 -v 1 -l 1 "$@" > "$work/churn.jobs"
+
+  start=$(date +%s%N)
+  EMS_STATS=text EMS_STATS_FILE="$work/stats" \
+    "$ems" "$work" 1 "$threads" 0 > /dev/null 2>&1
+  end=$(date +%s%N)
+
+  awk -v n="$n" -v ms="$(( (end - start) / 1000000 ))" '
+    /^  memory / { split($2, kv, "="); rss = kv[2] }
+    END { printf "%10d %10d %12d\n", n, ms, rss }' "$work/stats"
+done
@@ -0,0 +1,245 @@
+/// Synthetic .jobs workload generator for the EMS benchmarks.
+///
+/// Usage: jobgen [options] > file.jobs
+///   -e <events>    Number of events to create (default 4)
+///   -r <rows>      Rows of each event (default 32)
+///   -c <cols>      Columns of each event (default 32)
+///   -n <commands>  Number of commands after the CREATEs (default 1000)
+///   -s <seats>     Seats per reservation (default 2)
+///   -h <percent>   Reservations targeting an existing event (default 100)
+///   -x <percent>   Reservations conflicting with a reserved seat (default 0)
+///   -k <percent>   Reservations sent to the hot event 1 (default 0)
+///   -p <percent>   Reservations issued as a TXN (default 0)
+///   -o <count>     Reservations per TXN (default 2)
+///   -v <percent>   SHOW commands (default 5)
+///   -l <percent>   LIST commands (default 1)
+///   -u <percent>   Commands that DELETE an event and CREATE it again
+///                  (default 0)
+///   -b <commands>  Emit a BARRIER every <commands> commands (default 0, none)
+///   -w <percent>   WAIT commands (default 0)
+///   -d <ms>        Delay of the WAIT commands (default 1)
+///   -t <threads>   Target WAITs at a random thread in 1..threads, 0 for all
+///   -z <seed>      Random seed (default 1)
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../constants.h"
+
+struct Options {
+  unsigned long events;
+  unsigned long rows;
+  unsigned long cols;
+  unsigned long commands;
+  unsigned long seats;
+  unsigned long hit_pct;
+  unsigned long conflict_pct;
+  unsigned long hot_pct;
+  unsigned long txn_pct;
+  unsigned long txn_size;
+  unsigned long show_pct;
+  unsigned long list_pct;
+  unsigned long churn_pct;
+  unsigned long barrier_every;
+  unsigned long wait_pct;
+  unsigned long wait_ms;
+  unsigned long wait_threads;
+  unsigned long seed;
+};
+
+static unsigned long long rng_state;
+
+/// xorshift64*, so that every platform generates the same workload.
+static unsigned long random_below(unsigned long bound) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (unsigned long)((rng_state * 2685821657736338717ULL) >> 33) % bound;
+}
+
+static int chance(unsigned long percent) {
+  return random_below(100) < percent;
+}
+
+static int parse_option(const char *arg, unsigned long *value) {
+  char *endptr;
+  unsigned long parsed = strtoul(arg, &endptr, 10);
+  if (*arg == '\0' || *endptr != '\0' || parsed > UINT_MAX) {
+    return 1;
+  }
+  *value = parsed;
+  return 0;
+}
+
+static void print_seat(unsigned long index, const struct Options *opts) {
+  printf("(%lu,%lu)", index / opts->cols + 1, index % opts->cols + 1);
+}
+
+static void print_reserve(unsigned long *cursors, const struct Options *opts) {
+  unsigned long event;
+  if (!chance(opts->hit_pct)) {
+    event = opts->events + 1 + random_below(opts->events + 1);
+  } else if (chance(opts->hot_pct)) {
+    event = 1;
+  } else {
+    event = 1 + random_below(opts->events);
+  }
+
+  unsigned long capacity = opts->rows * opts->cols;
+  unsigned long *cursor = event <= opts->events ? &cursors[event - 1] : NULL;
+
+  printf("RESERVE %lu [", event);
+  for (unsigned long i = 0; i < opts->seats; i++) {
+    unsigned long index;
+    if (i == 0 && cursor != NULL && *cursor > 0 &&
+        chance(opts->conflict_pct)) {
+      index = random_below(*cursor);
+    } else if (cursor != NULL) {
+      index = (*cursor)++ % capacity;
+    } else {
+      index = random_below(capacity);
+    }
+
+    if (i > 0) {
+      printf(" ");
+    }
+    print_seat(index, opts);
+  }
+  printf("]\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct Options opts = {4, 32, 32, 1000, 2, 100, 0, 0, 0,
+                         2, 5,  1,  0,    0, 0, 1,   0, 1};
+
+  int opt;
+  const char *optstring = "e:r:c:n:s:h:x:k:p:o:v:l:u:b:w:d:t:z:";
+  while ((opt = getopt(argc, argv, optstring)) != -1) {
+    unsigned long *target;
+    switch (opt) {
+    case 'e':
+      target = &opts.events;
+      break;
+    case 'r':
+      target = &opts.rows;
+      break;
+    case 'c':
+      target = &opts.cols;
+      break;
+    case 'n':
+      target = &opts.commands;
+      break;
+    case 's':
+      target = &opts.seats;
+      break;
+    case 'h':
+      target = &opts.hit_pct;
+      break;
+    case 'x':
+      target = &opts.conflict_pct;
+      break;
+    case 'k':
+      target = &opts.hot_pct;
+      break;
+    case 'p':
+      target = &opts.txn_pct;
+      break;
+    case 'o':
+      target = &opts.txn_size;
+      break;
+    case 'v':
+      target = &opts.show_pct;
+      break;
+    case 'l':
+      target = &opts.list_pct;
+      break;
+    case 'u':
+      target = &opts.churn_pct;
+      break;
+    case 'b':
+      target = &opts.barrier_every;
+      break;
+    case 'w':
+      target = &opts.wait_pct;
+      break;
+    case 'd':
+      target = &opts.wait_ms;
+      break;
+    case 't':
+      target = &opts.wait_threads;
+      break;
+    case 'z':
+      target = &opts.seed;
+      break;
+    default:
+      fprintf(stderr, "See the top of bench/jobgen.c for usage\n");
+      return 1;
+    }
+
+    if (parse_option(optarg, target) != 0) {
+      fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+      return 1;
+    }
+  }
+
+  if (opts.events == 0 || opts.rows == 0 || opts.cols == 0 ||
+      opts.seats == 0 || opts.seats >= MAX_RESERVATION_SIZE) {
+    fprintf(stderr, "Events, rows, columns and seats must be positive and "
+                    "seats below %d\n",
+            MAX_RESERVATION_SIZE);
+    return 1;
+  }
+
+  rng_state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+  unsigned long *cursors = calloc(opts.events, sizeof(unsigned long));
+  if (cursors == NULL) {
+    fprintf(stderr, "Error allocating memory\n");
+    return 1;
+  }
+
+  for (unsigned long i = 1; i <= opts.events; i++) {
+    printf("CREATE %lu %lu %lu\n", i, opts.rows, opts.cols);
+  }
+  if (opts.barrier_every > 0) {
+    printf("BARRIER\n");
+  }
+
+  for (unsigned long i = 1; i <= opts.commands; i++) {
+    unsigned long roll = random_below(100);
+    if (roll < opts.show_pct) {
+      printf("SHOW %lu\n", 1 + random_below(opts.events));
+    } else if (roll < opts.show_pct + opts.list_pct) {
+      printf("LIST\n");
+    } else if (roll < opts.show_pct + opts.list_pct + opts.churn_pct) {
+      unsigned long event = 1 + random_below(opts.events);
+      printf("DELETE %lu\nCREATE %lu %lu %lu\n", event, event, opts.rows,
+             opts.cols);
+      cursors[event - 1] = 0;
+    } else if (roll < opts.show_pct + opts.list_pct + opts.churn_pct +
+                          opts.wait_pct) {
+      if (opts.wait_threads > 0) {
+        printf("WAIT %lu %lu\n", opts.wait_ms,
+               1 + random_below(opts.wait_threads));
+      } else {
+        printf("WAIT %lu\n", opts.wait_ms);
+      }
+    } else if (chance(opts.txn_pct)) {
+      printf("TXN\n");
+      for (unsigned long j = 0; j < opts.txn_size; j++) {
+        print_reserve(cursors, &opts);
+      }
+      printf("END\n");
+    } else {
+      print_reserve(cursors, &opts);
+    }
+
+    if (opts.barrier_every > 0 && i % opts.barrier_every == 0) {
+      printf("BARRIER\n");
+    }
+  }
+
+  free(cursors);
+  return 0;
+}
@@ -0,0 +1,266 @@
+/// Closed-loop load generator for the EMS server (ems -s <socket>).
+///
+/// Usage: loadgen [options]
+///   -s <socket>       Socket of the server (default /tmp/ems.sock)
+///   -c <connections>  Concurrent connections, one thread each (default 4)
+///   -n <requests>     Requests per connection (default 1000)
+///   -e <events>       Events created before the run (default 4)
+///   -r <rows>         Rows of each event (default 64)
+///   -k <cols>         Columns of each event (default 64)
+///   -v <percent>      Requests that are SHOWs instead of RESERVEs (default 0)
+///
+/// Every connection sends one request and waits for its status line before
+/// sending the next. Reports the throughput and the latency percentiles.
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Options {
+  const char *socket_path;
+  unsigned long connections;
+  unsigned long requests;
+  unsigned long events;
+  unsigned long rows;
+  unsigned long cols;
+  unsigned long show_pct;
+};
+
+struct Connection {
+  pthread_t thread;
+  unsigned long id;
+  const struct Options *opts;
+  unsigned long long *latencies; /// Latency of every request, in ns.
+  unsigned long errors;          /// Requests answered with ERR.
+  int failed;                    /// Set if the connection broke.
+};
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL +
+         (unsigned long long)ts.tv_nsec;
+}
+
+static int connect_server(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", socket_path,
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+/// Sends a command and reads its answer up to the status line.
+/// @return 0 if the server answered OK, 1 if ERR, -1 if the connection broke.
+static int request(int fd, const char *command) {
+  size_t len = strlen(command);
+  if (write(fd, command, len) != (ssize_t)len) {
+    return -1;
+  }
+
+  // Output lines are seat numbers or "Event: ...", so the first line that
+  // starts with "OK" or "ERR" is the status.
+  char line[64];
+  size_t used = 0;
+  char ch;
+  while (read(fd, &ch, 1) == 1) {
+    if (ch != '\n') {
+      if (used < sizeof(line) - 1) {
+        line[used++] = ch;
+      }
+      continue;
+    }
+    line[used] = '\0';
+    if (strcmp(line, "OK") == 0) {
+      return 0;
+    }
+    if (strcmp(line, "ERR") == 0) {
+      return 1;
+    }
+    used = 0;
+  }
+  return -1;
+}
+
+static void *run_connection(void *arg) {
+  struct Connection *conn = (struct Connection *)arg;
+  const struct Options *opts = conn->opts;
+  unsigned long capacity = opts->rows * opts->cols;
+  unsigned int seed = (unsigned int)conn->id + 1;
+
+  int fd = connect_server(opts->socket_path);
+  if (fd < 0) {
+    conn->failed = 1;
+    return NULL;
+  }
+
+  char command[128];
+  for (unsigned long i = 0; i < opts->requests; i++) {
+    // Without events every request fails, which measures the error path.
+    unsigned long event = 1;
+    if (opts->events > 0) {
+      event += (unsigned long)rand_r(&seed) % opts->events;
+    }
+    if ((unsigned long)rand_r(&seed) % 100 < opts->show_pct) {
+      snprintf(command, sizeof(command), "SHOW %lu\n", event);
+    } else {
+      unsigned long seat = (conn->id * opts->requests + i) % capacity;
+      snprintf(command, sizeof(command), "RESERVE %lu [(%lu,%lu)]\n", event,
+               seat / opts->cols + 1, seat % opts->cols + 1);
+    }
+
+    unsigned long long start = now_ns();
+    int result = request(fd, command);
+    conn->latencies[i] = now_ns() - start;
+    if (result < 0) {
+      conn->failed = 1;
+      break;
+    }
+    conn->errors += (unsigned long)result;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+/// Parses a decimal option value from min to max.
+static int parse_option(const char *arg, unsigned long min, unsigned long max,
+                        unsigned long *value) {
+  char *endptr;
+  unsigned long parsed = strtoul(arg, &endptr, 10);
+  if (*arg == '\0' || *arg == '-' || *endptr != '\0' || parsed < min ||
+      parsed > max) {
+    return 1;
+  }
+  *value = parsed;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct Options opts = {"/tmp/ems.sock", 4, 1000, 4, 64, 64, 0};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:n:e:r:k:v:")) != -1) {
+    unsigned long *target = NULL;
+    unsigned long min = 1;
+    unsigned long max = UINT_MAX;
+    switch (opt) {
+    case 's':
+      opts.socket_path = optarg;
+      continue;
+    case 'c':
+      target = &opts.connections;
+      break;
+    case 'n':
+      target = &opts.requests;
+      break;
+    case 'e':
+      target = &opts.events;
+      min = 0;
+      break;
+    case 'r':
+      target = &opts.rows;
+      break;
+    case 'k':
+      target = &opts.cols;
+      break;
+    case 'v':
+      target = &opts.show_pct;
+      min = 0;
+      max = 100;
+      break;
+    default:
+      fprintf(stderr, "See the top of bench/loadgen.c for usage\n");
+      return 1;
+    }
+
+    if (parse_option(optarg, min, max, target) != 0) {
+      fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+      return 1;
+    }
+  }
+
+  int fd = connect_server(opts.socket_path);
+  if (fd < 0) {
+    return 1;
+  }
+  char command[128];
+  for (unsigned long i = 1; i <= opts.events; i++) {
+    snprintf(command, sizeof(command), "CREATE %lu %lu %lu\n", i, opts.rows,
+             opts.cols);
+    if (request(fd, command) < 0) {
+      fprintf(stderr, "Connection closed while creating events\n");
+      close(fd);
+      return 1;
+    }
+  }
+  close(fd);
+
+  struct Connection *conns = calloc(opts.connections, sizeof(*conns));
+  unsigned long long *latencies =
+      calloc(opts.connections * opts.requests, sizeof(unsigned long long));
+  if (conns == NULL || latencies == NULL) {
+    fprintf(stderr, "Error allocating memory\n");
+    return 1;
+  }
+
+  unsigned long long start = now_ns();
+  for (unsigned long i = 0; i < opts.connections; i++) {
+    conns[i].id = i;
+    conns[i].opts = &opts;
+    conns[i].latencies = &latencies[i * opts.requests];
+    pthread_create(&conns[i].thread, NULL, run_connection, &conns[i]);
+  }
+
+  unsigned long errors = 0;
+  int failed = 0;
+  for (unsigned long i = 0; i < opts.connections; i++) {
+    pthread_join(conns[i].thread, NULL);
+    errors += conns[i].errors;
+    failed |= conns[i].failed;
+  }
+  double elapsed_s = (double)(now_ns() - start) / 1e9;
+
+  size_t total = opts.connections * opts.requests;
+  qsort(latencies, total, sizeof(unsigned long long), compare_latencies);
+  printf("%lu connections x %lu requests in %.3f s: %.0f req/s, %lu ERR\n",
+         opts.connections, opts.requests, elapsed_s, (double)total / elapsed_s,
+         errors);
+  printf("latency us: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+         (double)latencies[total / 2] / 1e3,
+         (double)latencies[total * 90 / 100] / 1e3,
+         (double)latencies[total * 99 / 100] / 1e3,
+         (double)latencies[total - 1] / 1e3);
+  if (failed) {
+    fprintf(stderr, "Some connections failed\n");
+  }
+
+  free(latencies);
+  free(conns);
+  return failed;
+}
@@ -0,0 +1,168 @@
+#include "collector.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "aux.h"
+#include "constants.h"
+#include "stats.h"
+
+/// Output of a line, waiting to be written.
+struct OutputEntry {
+  int line;
+  size_t len;
+  char *output; /// NULL if the line wrote nothing.
+  struct OutputEntry *next;
+};
+
+struct OutputCollector {
+  int fd_out;
+  _Atomic(struct OutputEntry *) submitted; /// Newest first.
+  atomic_flag emitting; /// Set while a thread writes, guards the fields below.
+  int next_line;        /// Next line to write.
+  struct OutputEntry *pending; /// Lines waiting for an earlier one, in order.
+  struct OutputEntry *pending_tail;
+};
+
+struct OutputCollector *collector_create(int fd_out) {
+  struct OutputCollector *collector = malloc(sizeof(struct OutputCollector));
+  if (collector == NULL) {
+    fprintf(stderr, "Error allocating memory for output collector\n");
+    return NULL;
+  }
+  collector->fd_out = fd_out;
+  atomic_init(&collector->submitted, NULL);
+  atomic_flag_clear(&collector->emitting);
+  collector->next_line = 1;
+  collector->pending = NULL;
+  collector->pending_tail = NULL;
+  return collector;
+}
+
+void collector_destroy(struct OutputCollector *collector) { free(collector); }
+
+/// Moves the submitted lines to the pending ones, keeping them in order.
+/// @note The caller must be emitting.
+static void take_submitted(struct OutputCollector *collector) {
+  struct OutputEntry *entry = atomic_exchange(&collector->submitted, NULL);
+
+  // Oldest first, so that most lines go right at the tail.
+  struct OutputEntry *oldest = NULL;
+  while (entry != NULL) {
+    struct OutputEntry *next = entry->next;
+    entry->next = oldest;
+    oldest = entry;
+    entry = next;
+  }
+
+  while (oldest != NULL) {
+    entry = oldest;
+    oldest = entry->next;
+
+    if (collector->pending_tail == NULL ||
+        collector->pending_tail->line < entry->line) {
+      entry->next = NULL;
+      if (collector->pending_tail == NULL) {
+        collector->pending = entry;
+      } else {
+        collector->pending_tail->next = entry;
+      }
+      collector->pending_tail = entry;
+      continue;
+    }
+
+    struct OutputEntry **link = &collector->pending;
+    while ((*link)->line < entry->line) {
+      link = &(*link)->next;
+    }
+    entry->next = *link;
+    *link = entry;
+  }
+}
+
+/// Writes the pending lines that are next in order, or all of them.
+/// @note The caller must be emitting.
+static void write_pending(struct OutputCollector *collector, int all) {
+  while (1) {
+    struct iovec iov[MAX_OUTPUT_IOVECS];
+    struct OutputEntry *written = NULL;
+    int iovcnt = 0;
+    int count = 0;
+    while (count < MAX_OUTPUT_IOVECS && collector->pending != NULL &&
+           (all || collector->pending->line == collector->next_line)) {
+      struct OutputEntry *entry = collector->pending;
+      collector->pending = entry->next;
+      if (collector->pending == NULL) {
+        collector->pending_tail = NULL;
+      }
+      collector->next_line = entry->line + 1;
+
+      if (entry->len > 0) {
+        iov[iovcnt++] = (struct iovec){entry->output, entry->len};
+      }
+      entry->next = written;
+      written = entry;
+      count++;
+    }
+    if (count == 0) {
+      return;
+    }
+
+    if (iovcnt > 0) {
+      STATS_START(start);
+      if (writev_all(collector->fd_out, iov, iovcnt) != 0) {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+      }
+      STATS_RECORD(STATS_WRITE, start);
+    }
+
+    while (written != NULL) {
+      struct OutputEntry *next = written->next;
+      free(written->output);
+      free(written);
+      written = next;
+    }
+  }
+}
+
+void collector_submit(struct OutputCollector *collector, int line,
+                      char *output, size_t len) {
+  struct OutputEntry *entry = malloc(sizeof(struct OutputEntry));
+  if (entry == NULL) {
+    // The lines after it are held back until the next flush.
+    fprintf(stderr, "Error allocating memory for output of line %d\n", line);
+    free(output);
+    return;
+  }
+  entry->line = line;
+  entry->len = len;
+  entry->output = output;
+  entry->next = atomic_load(&collector->submitted);
+  while (!atomic_compare_exchange_weak(&collector->submitted, &entry->next,
+                                       entry))
+    ;
+
+  // Whoever is emitting checks for new lines after it stops, so a thread
+  // that finds another one emitting can leave its line behind.
+  while (!atomic_flag_test_and_set(&collector->emitting)) {
+    take_submitted(collector);
+    write_pending(collector, 0);
+    atomic_flag_clear(&collector->emitting);
+    if (atomic_load(&collector->submitted) == NULL) {
+      break;
+    }
+  }
+}
+
+void collector_flush(struct OutputCollector *collector) {
+  while (atomic_flag_test_and_set(&collector->emitting))
+    ;
+  take_submitted(collector);
+  write_pending(collector, 1);
+  collector->next_line = 1;
+  atomic_flag_clear(&collector->emitting);
+}
@@ -0,0 +1,39 @@
+#ifndef EMS_COLLECTOR_H
+#define EMS_COLLECTOR_H
+
+#include <stddef.h>
+
+/// Writes the output of the commands of a job file in the order of their
+/// lines, whichever thread executes them and whenever they finish.
+///
+/// The thread that executes a line submits its output, possibly empty, to a
+/// lock-free stack. Whichever submitter finds no other thread emitting takes
+/// over: it sorts what was submitted into the lines waiting for an earlier
+/// one and writes every line that is next in order, in batches of up to
+/// MAX_OUTPUT_IOVECS with writev. Submitters never wait for each other.
+struct OutputCollector;
+
+/// Creates a collector writing to fd_out, expecting line 1 first.
+/// @return The collector, NULL on failure.
+struct OutputCollector *collector_create(int fd_out);
+
+/// Destroys a collector.
+/// @note collector_flush must be called first.
+void collector_destroy(struct OutputCollector *collector);
+
+/// Submits the output of a line. Every line of the job file must be submitted
+/// exactly once by the thread that executes it.
+/// @param line Line of the command, starting at 1.
+/// @param output Output of the command, NULL if it wrote nothing. Owned by
+/// the collector from now on.
+/// @param len Length of the output.
+void collector_submit(struct OutputCollector *collector, int line,
+                      char *output, size_t len);
+
+/// Writes every line submitted, in order, even if earlier lines were never
+/// submitted, and expects line 1 next.
+/// @note No thread may be submitting, e.g. at a BARRIER or at the end of the
+/// job file, where the line count starts over.
+void collector_flush(struct OutputCollector *collector);
+
+#endif // EMS_COLLECTOR_H
@@ -0,0 +1,163 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+static struct EmsConfig config = {
+    .procs = MAX_PROC,
+    .threads = MAX_THREADS,
+    .delay = STATE_ACCESS_DELAY_MS,
+    .max_reservation = MAX_RESERVATION_SIZE,
+    .adaptive = 0,
+    .adaptive_max_threads = 0,
+    .shards = 0,
+    .shared_mb = 0,
+    .priority = 0,
+    .read_deadline = READ_DEADLINE_MS,
+};
+
+/// A setting and the values it accepts.
+struct ConfigKey {
+  const char *name;
+  size_t offset;
+  unsigned long min;
+  unsigned long max;
+};
+
+static const struct ConfigKey keys[] = {
+    {"procs", offsetof(struct EmsConfig, procs), 1, INT_MAX},
+    {"threads", offsetof(struct EmsConfig, threads), 1, MAX_THREADS_LIMIT},
+    {"delay", offsetof(struct EmsConfig, delay), 0, UINT_MAX},
+    {"max_reservation", offsetof(struct EmsConfig, max_reservation), 1,
+     MAX_RESERVATION_LIMIT},
+    {"adaptive", offsetof(struct EmsConfig, adaptive), 0, 1},
+    {"adaptive_max_threads", offsetof(struct EmsConfig, adaptive_max_threads),
+     0, MAX_THREADS_LIMIT},
+    {"shards", offsetof(struct EmsConfig, shards), 0, MAX_SHARDS},
+    {"shared_mb", offsetof(struct EmsConfig, shared_mb), 0,
+     SHARED_STATE_MAX_MB},
+    {"priority", offsetof(struct EmsConfig, priority), 0, 1},
+    {"read_deadline", offsetof(struct EmsConfig, read_deadline), 0, UINT_MAX},
+};
+
+#define NUM_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+struct EmsConfig *config_get(void) { return &config; }
+
+int config_set(struct EmsConfig *cfg, const char *key, const char *value) {
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    if (strcmp(keys[i].name, key) != 0) {
+      continue;
+    }
+
+    char *endptr;
+    errno = 0;
+    unsigned long number = strtoul(value, &endptr, 10);
+    if (*value == '\0' || *value == '-' || *endptr != '\0' || errno != 0 ||
+        number < keys[i].min || number > keys[i].max) {
+      fprintf(stderr, "Invalid %s value \"%s\", must be %lu to %lu\n", key,
+              value, keys[i].min, keys[i].max);
+      return 1;
+    }
+    *(unsigned long *)((char *)cfg + keys[i].offset) = number;
+    return 0;
+  }
+
+  fprintf(stderr, "Unknown setting \"%s\"\n", key);
+  return 1;
+}
+
+int config_set_pair(struct EmsConfig *cfg, const char *pair) {
+  char key[64];
+  const char *equals = strchr(pair, '=');
+  if (equals == NULL || (size_t)(equals - pair) >= sizeof(key)) {
+    fprintf(stderr, "Invalid setting \"%s\", must be key=value\n", pair);
+    return 1;
+  }
+  memcpy(key, pair, (size_t)(equals - pair));
+  key[equals - pair] = '\0';
+  return config_set(cfg, key, equals + 1);
+}
+
+/// Strips the blanks around a string in place.
+static char *trim(char *string) {
+  while (isspace((unsigned char)*string)) {
+    string++;
+  }
+  size_t len = strlen(string);
+  while (len > 0 && isspace((unsigned char)string[len - 1])) {
+    string[--len] = '\0';
+  }
+  return string;
+}
+
+int config_load_file(struct EmsConfig *cfg, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open config file %s: %s\n", path,
+            strerror(errno));
+    return 1;
+  }
+
+  char buf[256];
+  int line = 0;
+  int failed = 0;
+  while (fgets(buf, sizeof(buf), file) != NULL) {
+    line++;
+    char *comment = strchr(buf, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char *text = trim(buf);
+    if (*text == '\0') {
+      continue;
+    }
+
+    char *equals = strchr(text, '=');
+    if (equals == NULL) {
+      fprintf(stderr, "%s:%d: expected key = value\n", path, line);
+      failed = 1;
+      continue;
+    }
+    *equals = '\0';
+    if (config_set(cfg, trim(text), trim(equals + 1)) != 0) {
+      fprintf(stderr, "%s:%d: invalid setting\n", path, line);
+      failed = 1;
+    }
+  }
+
+  fclose(file);
+  return failed;
+}
+
+int config_load_env(struct EmsConfig *cfg) {
+  int failed = 0;
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    char name[64] = "EMS_";
+    size_t len = strlen(name);
+    for (const char *c = keys[i].name; *c != '\0' && len + 1 < sizeof(name);
+         c++) {
+      name[len++] = (char)toupper((unsigned char)*c);
+    }
+    name[len] = '\0';
+
+    const char *value = getenv(name);
+    if (value != NULL && config_set(cfg, keys[i].name, value) != 0) {
+      fprintf(stderr, "Invalid environment variable %s\n", name);
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+unsigned long config_num_cpus(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (unsigned long)cpus : 1;
+}
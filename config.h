@@ -0,0 +1,56 @@
+#ifndef EMS_CONFIG_H
+#define EMS_CONFIG_H
+
+#include <stddef.h>
+
+/// Runtime settings of ems. Every setting starts at its default from
+/// constants.h and is then overridden, in order, by the config file, by the
+/// environment and by the command line.
+///
+/// The config file (-c <path> or EMS_CONFIG) has one "key = value" per line,
+/// '#' starts a comment. The environment variable of a key is EMS_ followed
+/// by the key in upper case, e.g. EMS_DELAY for delay.
+struct EmsConfig {
+  unsigned long procs;           /// procs: job files run at once.
+  unsigned long threads;         /// threads: threads per job file.
+  unsigned long delay;           /// delay: state access delay in ms.
+  unsigned long max_reservation; /// max_reservation: seats and blocks
+                                 /// per RESERVE.
+  unsigned long adaptive;        /// adaptive: 1 to tune the threads.
+  unsigned long adaptive_max_threads; /// adaptive_max_threads: 0 for 4 per
+                                      /// online CPU.
+  unsigned long shards;    /// shards: shard processes per job file, 0 for
+                           /// none.
+  unsigned long shared_mb; /// shared_mb: shared state size, 0 for none.
+  unsigned long priority;  /// priority: 1 to run SHOW and LIST behind the
+                           /// writes.
+  unsigned long read_deadline; /// read_deadline: ms a deferred read may wait.
+};
+
+/// Gets the settings of this process.
+/// @note Children forked afterwards inherit them.
+struct EmsConfig *config_get(void);
+
+/// Sets a setting from its text value, checking that it is in range.
+/// @param key Name of the setting.
+/// @param value Text of the value, a decimal number.
+/// @return 0 if the setting was set, 1 if the key is unknown or the value is
+/// invalid.
+int config_set(struct EmsConfig *config, const char *key, const char *value);
+
+/// Sets a setting from a "key=value" pair.
+/// @return 0 if the setting was set, 1 otherwise.
+int config_set_pair(struct EmsConfig *config, const char *pair);
+
+/// Sets the settings found in a config file.
+/// @return 0 if the file was read and every setting was valid, 1 otherwise.
+int config_load_file(struct EmsConfig *config, const char *path);
+
+/// Sets the settings found in the environment.
+/// @return 0 if every setting found was valid, 1 otherwise.
+int config_load_env(struct EmsConfig *config);
+
+/// Gets the number of online CPUs, at least 1.
+unsigned long config_num_cpus(void);
+
+#endif // EMS_CONFIG_H
@@ -1,6 +1,25 @@
 #define MAX_RESERVATION_SIZE 256
+#define MAX_RESERVATION_LIMIT 65536
 #define STATE_ACCESS_DELAY_MS 10
 #define MAX_PROC 1
 #define MAX_THREADS 1
 #define INPUT_EXTENSION ".jobs"
 #define OUTPUT_EXTENSION ".out"
+#define SERVER_MAX_CONNECTIONS 1024
+#define SERVER_INPUT_BUFFER 4096
+#define SERVER_MAX_COMMAND (1 << 20)
+#define MAX_BATCH_SIZE 256
+#define MAX_BATCH_SEATS 4096
+#define MAX_FREE_SEAT_BUFFERS 16
+#define MAX_SHARDS 64
+#define SHARD_WINDOW 1024
+#define SHARED_STATE_MAX_MB 65536
+#define MAX_OUTPUT_IOVECS 64
+#define MAX_THREADS_LIMIT 1024
+#define ADAPTIVE_MIN_COMMANDS 16
+#define ADAPTIVE_TOLERANCE 0.05
+#define ADAPTIVE_SETTLE_STRETCHES 8
+#define READ_DEADLINE_MS 100
+#define STREAM_QUEUE_SIZE 64
+#define STREAM_MAX_LINES (1 << 30)
+#define LIST_MAX_RETRIES 8
@@ -0,0 +1,78 @@
+#include "controller.h"
+
+#include <time.h>
+
+#include "config.h"
+#include "constants.h"
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void controller_init(struct ThreadController *controller, int max_threads) {
+  unsigned long cpus = config_num_cpus();
+  controller->max_threads = max_threads;
+  controller->threads =
+      cpus < (unsigned long)max_threads ? (int)cpus : max_threads;
+  controller->growing = 1;
+  controller->settled = 0;
+  controller->last_rate = 0;
+  controller->last_commands = 0;
+  controller->start = now_ns();
+}
+
+void controller_start(struct ThreadController *controller) {
+  controller->start = now_ns();
+}
+
+/// Doubles or halves the threads, turning around at the limits.
+static void step(struct ThreadController *controller) {
+  if (controller->growing && controller->threads >= controller->max_threads) {
+    controller->growing = 0;
+  } else if (!controller->growing && controller->threads <= 1) {
+    controller->growing = 1;
+  }
+
+  int threads = controller->growing ? controller->threads * 2
+                                    : controller->threads / 2;
+  if (threads > controller->max_threads) {
+    threads = controller->max_threads;
+  }
+  controller->threads = threads < 1 ? 1 : threads;
+}
+
+int controller_next(struct ThreadController *controller, size_t commands) {
+  uint64_t elapsed = now_ns() - controller->start;
+  if (commands < ADAPTIVE_MIN_COMMANDS || elapsed == 0) {
+    return controller->threads;
+  }
+
+  double rate = (double)commands * 1e9 / (double)elapsed;
+  // Stretches of very different lengths are usually different kinds of
+  // work, e.g. the CREATEs before the first BARRIER.
+  int comparable = controller->last_rate > 0 &&
+                   commands <= 2 * controller->last_commands &&
+                   controller->last_commands <= 2 * commands;
+  int worse =
+      comparable && rate < controller->last_rate * (1 - ADAPTIVE_TOLERANCE);
+  controller->last_rate = rate;
+  controller->last_commands = commands;
+
+  if (controller->settled > 0) {
+    // Probe the other side once in a while, the work may have changed.
+    if (--controller->settled == 0) {
+      step(controller);
+    }
+  } else if (worse) {
+    // Undo the last move and stay there for a while.
+    controller->growing = !controller->growing;
+    step(controller);
+    controller->settled = ADAPTIVE_SETTLE_STRETCHES;
+    controller->last_rate = 0;
+  } else {
+    step(controller);
+  }
+  return controller->threads;
+}
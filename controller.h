@@ -0,0 +1,40 @@
+#ifndef EMS_CONTROLLER_H
+#define EMS_CONTROLLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Picks the number of threads of a job file at every BARRIER.
+///
+/// The controller starts from one thread per online CPU and measures the
+/// throughput of every stretch of commands between BARRIERs. It doubles or
+/// halves the threads of the next stretch, within 1 and max_threads, keeping
+/// the direction while the throughput does not drop. Once it drops, the last
+/// move is undone and the threads stay for ADAPTIVE_SETTLE_STRETCHES
+/// stretches, after which the other direction is probed. Stretches shorter
+/// than ADAPTIVE_MIN_COMMANDS are too noisy to measure and leave the threads
+/// as they are.
+struct ThreadController {
+  int threads;      /// Threads of the current stretch.
+  int max_threads;  /// Most threads the controller may pick.
+  int growing;      /// 1 if the threads went up last, 0 if they went down.
+  int settled;      /// Stretches left before probing again, 0 if probing.
+  double last_rate; /// Commands per second of the last stretch, 0 if none.
+  size_t last_commands; /// Commands of the last stretch.
+  uint64_t start;       /// When the current stretch started, in ns.
+};
+
+/// Initializes a controller.
+/// @param max_threads Most threads the controller may pick.
+void controller_init(struct ThreadController *controller, int max_threads);
+
+/// Marks the start of a stretch of commands.
+void controller_start(struct ThreadController *controller);
+
+/// Measures the stretch that just ended and picks the threads of the next
+/// one.
+/// @param commands Number of commands in the stretch.
+/// @return The threads of the next stretch.
+int controller_next(struct ThreadController *controller, size_t commands);
+
+#endif // EMS_CONTROLLER_H
@@ -0,0 +1,233 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "region.h"
+
+/// An object waiting for its grace period to end.
+struct Retired {
+  void *object;
+  void (*destroy)(void *);
+  unsigned long epoch; /// Global epoch when the object was retired.
+  struct Retired *next;
+};
+
+/// State of a thread that uses epoch_enter. Records are never freed: the
+/// record of a thread that finished is reused by the next thread, along with
+/// the objects it retired that are still waiting.
+struct EpochRecord {
+  atomic_int in_use;        /// Set while a thread owns the record.
+  atomic_int pid;           /// Process of the thread that owns the record.
+  atomic_ulong epoch;       /// Epoch seen on entering, 0 if outside.
+  /// Objects retired by the owner, oldest first. Only the owner touches
+  /// them, and since the global epoch never goes back they are also sorted
+  /// by epoch, so the expired ones are always at the front.
+  struct Retired *retired;
+  struct Retired *retired_tail;
+  struct EpochRecord *next; /// Next record in the registry.
+};
+
+/// Epochs and readers of the EMS state. Lives in the shared region once
+/// epoch_share is called.
+struct EpochState {
+  /// Starts at 1 so that 0 can mean "outside a critical section".
+  atomic_ulong global_epoch;
+  _Atomic(struct EpochRecord *) records;
+};
+
+static struct EpochState private_state = {
+    .global_epoch = 1,
+    .records = NULL,
+};
+static struct EpochState *state = &private_state;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static _Thread_local struct EpochRecord *local = NULL;
+static _Thread_local unsigned int depth = 0;
+
+static void release_record(void *data) {
+  struct EpochRecord *record = (struct EpochRecord *)data;
+  atomic_store(&record->epoch, 0);
+  atomic_store(&record->in_use, 0);
+}
+
+static void epoch_setup(void) {
+  pthread_key_create(&epoch_key, release_record);
+}
+
+/// Takes a free record from the registry, or adds a new one.
+static struct EpochRecord *acquire_record(void) {
+  pthread_once(&epoch_once, epoch_setup);
+
+  struct EpochRecord *record = atomic_load(&state->records);
+  for (; record != NULL; record = record->next) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&record->in_use, &expected, 1)) {
+      break;
+    }
+  }
+
+  if (record == NULL) {
+    record = region_alloc(sizeof(struct EpochRecord));
+    if (record == NULL) {
+      fprintf(stderr, "Error allocating memory for epoch record\n");
+      exit(EXIT_FAILURE);
+    }
+    atomic_init(&record->in_use, 1);
+    atomic_init(&record->pid, 0);
+    atomic_init(&record->epoch, 0);
+    record->retired = NULL;
+    record->retired_tail = NULL;
+    record->next = atomic_load(&state->records);
+    while (!atomic_compare_exchange_weak(&state->records, &record->next,
+                                         record))
+      ;
+  }
+
+  atomic_store(&record->pid, (int)getpid());
+  pthread_setspecific(epoch_key, record);
+  return record;
+}
+
+void epoch_enter(void) {
+  if (depth++ > 0) {
+    return;
+  }
+  if (local == NULL) {
+    local = acquire_record();
+  }
+  atomic_store(&local->epoch, atomic_load(&state->global_epoch));
+}
+
+/// Unlinks the objects retired by the calling thread whose grace period has
+/// ended, advancing the epoch first if possible.
+static struct Retired *take_expired(void) {
+  // The epoch can only advance once every thread in a critical section has
+  // seen the current one.
+  unsigned long epoch = atomic_load(&state->global_epoch);
+  int advance = 1;
+  for (struct EpochRecord *record = atomic_load(&state->records);
+       record != NULL; record = record->next) {
+    unsigned long seen = atomic_load(&record->epoch);
+    if (seen != 0 && seen != epoch) {
+      advance = 0;
+      break;
+    }
+  }
+  if (advance && atomic_compare_exchange_strong(&state->global_epoch,
+                                                &epoch, epoch + 1)) {
+    epoch++;
+  }
+
+  // Readers that entered before an object was retired have all left once
+  // the epoch has advanced twice since.
+  struct Retired *expired = local->retired;
+  struct Retired *last = NULL;
+  for (struct Retired *entry = expired;
+       entry != NULL && entry->epoch + 2 <= epoch; entry = entry->next) {
+    last = entry;
+  }
+  if (last == NULL) {
+    return NULL;
+  }
+  local->retired = last->next;
+  if (local->retired == NULL) {
+    local->retired_tail = NULL;
+  }
+  last->next = NULL;
+  return expired;
+}
+
+static void destroy_all(struct Retired *entry) {
+  while (entry != NULL) {
+    struct Retired *next = entry->next;
+    entry->destroy(entry->object);
+    region_free(entry);
+    entry = next;
+  }
+}
+
+void epoch_exit(void) {
+  if (--depth > 0) {
+    return;
+  }
+  atomic_store(&local->epoch, 0);
+
+  // Help reclaim while objects are pending.
+  if (local->retired != NULL) {
+    destroy_all(take_expired());
+  }
+}
+
+void epoch_retire(void *object, void (*destroy)(void *)) {
+  struct Retired *entry = region_alloc(sizeof(struct Retired));
+  if (entry == NULL) {
+    // Leaking is the only safe option while readers may hold the object.
+    fprintf(stderr, "Error allocating memory for retired object\n");
+    return;
+  }
+  if (local == NULL) {
+    local = acquire_record();
+  }
+  entry->object = object;
+  entry->destroy = destroy;
+  entry->epoch = atomic_load(&state->global_epoch);
+  entry->next = NULL;
+  if (local->retired_tail == NULL) {
+    local->retired = entry;
+  } else {
+    local->retired_tail->next = entry;
+  }
+  local->retired_tail = entry;
+
+  if (depth == 0) {
+    destroy_all(take_expired());
+  }
+}
+
+void epoch_drain(void) {
+  for (struct EpochRecord *record = atomic_load(&state->records);
+       record != NULL; record = record->next) {
+    struct Retired *all = record->retired;
+    record->retired = NULL;
+    record->retired_tail = NULL;
+    destroy_all(all);
+  }
+}
+
+void epoch_forget(pid_t pid) {
+  for (struct EpochRecord *record = atomic_load(&state->records);
+       record != NULL; record = record->next) {
+    if (atomic_load(&record->in_use) && atomic_load(&record->pid) == pid) {
+      // Its retired objects wait for the next owner of the record.
+      atomic_store(&record->epoch, 0);
+      atomic_store(&record->in_use, 0);
+    }
+  }
+}
+
+/// Drops the record of the thread that forked, which belongs to the parent.
+static void forget_record(void) {
+  local = NULL;
+  depth = 0;
+}
+
+int epoch_share(void) {
+  struct EpochState *shared = region_alloc(sizeof(struct EpochState));
+  if (shared == NULL) {
+    fprintf(stderr, "Error allocating memory for epoch state\n");
+    return 1;
+  }
+  atomic_init(&shared->global_epoch, 1);
+  atomic_init(&shared->records, NULL);
+
+  pthread_atfork(NULL, NULL, forget_record);
+  state = shared;
+  return 0;
+}
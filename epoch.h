@@ -0,0 +1,45 @@
+#ifndef EMS_EPOCH_H
+#define EMS_EPOCH_H
+
+#include <sys/types.h>
+
+/// Epoch-based memory reclamation.
+///
+/// Readers wrap every access to shared objects that may be unlinked
+/// concurrently in epoch_enter() and epoch_exit(). Writers unlink an object
+/// and hand it to epoch_retire(), which frees it once every reader that could
+/// still hold a reference to it has left its critical section. A retired
+/// object is freed two epochs after it was retired, and the global epoch only
+/// advances when every thread inside a critical section has seen the current
+/// one. Every thread keeps the objects it retired in its own list, oldest
+/// first, and frees the expired ones when it retires another one or leaves
+/// its critical section, without locking.
+
+/// Enters a read-side critical section. May be nested.
+void epoch_enter(void);
+
+/// Leaves a read-side critical section.
+void epoch_exit(void);
+
+/// Frees an object once no reader can reference it anymore.
+/// @param object Object that is no longer reachable by new readers.
+/// @param destroy Function that frees the object.
+void epoch_retire(void *object, void (*destroy)(void *));
+
+/// Frees every retired object.
+/// @note No thread may be inside a critical section.
+void epoch_drain(void);
+
+/// Releases the records of a process that ended, so that a reader that died
+/// inside a critical section does not hold back the epoch forever.
+/// @param pid Process that was reaped.
+void epoch_forget(pid_t pid);
+
+/// Moves the epoch state to the shared region, so that readers in every
+/// process forked afterwards hold back the reclamation of shared objects.
+/// @note Must be called right after region_create, before any other epoch
+/// function.
+/// @return 0 if the state was moved successfully, 1 otherwise.
+int epoch_share(void);
+
+#endif // EMS_EPOCH_H
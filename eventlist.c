@@ -1,78 +1,296 @@
 #include "eventlist.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "region.h"
 
 struct EventList *create_list() {
-  struct EventList *list = (struct EventList *)malloc(sizeof(struct EventList));
+  struct EventList *list =
+      (struct EventList *)region_alloc(sizeof(struct EventList));
   if (!list)
     return NULL;
   list->head = NULL;
   list->tail = NULL;
-  pthread_mutex_init(&list->mutex, NULL);
+  atomic_init(&list->changes, 0);
+  ems_mutex_init(&list->mutex);
   return list;
 }
 
+/// Marks the start of a change to the links of the list.
+static void begin_change(struct EventList *list) {
+  atomic_fetch_add_explicit(&list->changes, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+/// Marks the end of a change started with begin_change.
+static void end_change(struct EventList *list) {
+  atomic_fetch_add_explicit(&list->changes, 1, memory_order_release);
+}
+
 int append_to_list(struct EventList *list, struct Event *event) {
   if (!list)
     return 1;
 
   struct ListNode *new_node =
-      (struct ListNode *)malloc(sizeof(struct ListNode));
+      (struct ListNode *)region_alloc(sizeof(struct ListNode));
   if (!new_node)
     return 1;
 
   new_node->event = event;
-  new_node->next = NULL;
+  atomic_init(&new_node->next, NULL);
 
-  if (list->head == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
+  begin_change(list);
+  // The release stores publish the initialized event to lock-free readers.
+  if (list->tail == NULL) {
+    atomic_store_explicit(&list->head, new_node, memory_order_release);
   } else {
-    list->tail->next = new_node;
-    list->tail = new_node;
+    atomic_store_explicit(&list->tail->next, new_node, memory_order_release);
   }
+  list->tail = new_node;
+  end_change(list);
 
   return 0;
 }
 
+void free_seat_version(struct SeatVersion *version) {
+  if (version == NULL) {
+    return;
+  }
+  size_t num_chunks = seat_version_chunks(version->num_rows);
+  for (size_t i = 0; i < num_chunks; i++) {
+    for (size_t j = 0; j < SEAT_CHUNK_ROWS; j++) {
+      region_free(version->chunks[i]->rows[j]);
+    }
+    region_free(version->chunks[i]);
+  }
+  region_free(version);
+}
+
 static void free_event(struct Event *event) {
   if (!event)
     return;
 
-  free(event->data);
-  free(event);
+  for (size_t i = 0; i < event->reservations; i++) {
+    region_free(event->records[i].buffer);
+  }
+  region_free(event->records);
+
+  while (event->free_buffers) {
+    struct SeatBuffer *buffer = event->free_buffers;
+    event->free_buffers = buffer->next;
+    region_free(buffer);
+  }
+
+  // Earlier versions and the rows they did not share were retired by the
+  // writes that replaced them.
+  free_seat_version(atomic_load(&event->version));
+  region_free(event->dirty_rows);
+  region_free(event->data);
+  region_free(event);
+}
+
+static void free_node(void *data) {
+  struct ListNode *node = (struct ListNode *)data;
+  ems_mutex_destroy(&node->event->mutex);
+  free_event(node->event);
+  region_free(node);
+}
+
+int remove_from_list(struct EventList *list, struct Event *event) {
+  if (!list)
+    return 1;
+
+  struct ListNode *prev = NULL;
+  struct ListNode *current = atomic_load(&list->head);
+  while (current && current->event != event) {
+    prev = current;
+    current = atomic_load(&current->next);
+  }
+  if (!current)
+    return 1;
+
+  // The node keeps its next pointer, so readers standing on it can go on.
+  struct ListNode *next = atomic_load(&current->next);
+  begin_change(list);
+  if (prev) {
+    atomic_store(&prev->next, next);
+  } else {
+    atomic_store(&list->head, next);
+  }
+  end_change(list);
+  if (list->tail == current) {
+    list->tail = prev;
+  }
+
+  epoch_retire(current, free_node);
+  return 0;
 }
 
 void free_list(struct EventList *list) {
   if (!list)
     return;
 
-  struct ListNode *current = list->head;
+  struct ListNode *current = atomic_load(&list->head);
   while (current) {
     struct ListNode *temp = current;
-    current = current->next;
-    
-    pthread_mutex_destroy(&temp->event->mutex);
-    free_event(temp->event);
-    free(temp);
+    current = atomic_load(&current->next);
+    free_node(temp);
   }
 
-  free(list);
+  region_free(list);
 }
 
 struct Event *get_event(struct EventList *list, unsigned int event_id) {
   if (!list)
     return NULL;
 
-  struct ListNode *current = list->head;
+  struct ListNode *current =
+      atomic_load_explicit(&list->head, memory_order_acquire);
   while (current) {
     struct Event *event = current->event;
     if (event->id == event_id) {
       return event;
     }
-    current = current->next;
+    current = atomic_load_explicit(&current->next, memory_order_acquire);
   }
 
   return NULL;
 }
+
+#ifdef EMS_STATS
+
+/// Number of event mutexes listed in the contention report.
+#define REPORT_TOP_EVENTS 10
+
+int ems_mutex_init(struct EmsMutex *mutex) {
+  mutex->acquisitions = 0;
+  mutex->contended = 0;
+  mutex->wait_ns = 0;
+  mutex->max_wait_ns = 0;
+  mutex->blocker_cmd = -1;
+  mutex->blocker_line = 0;
+  atomic_init(&mutex->owner_cmd, -1);
+  atomic_init(&mutex->owner_line, 0);
+  return region_mutex_init(&mutex->mutex);
+}
+
+void ems_mutex_lock(struct EmsMutex *mutex) {
+  if (!stats_enabled()) {
+    TRACE_START(trace_start);
+    region_mutex_lock(&mutex->mutex);
+    TRACE_COMPLETE("lock wait", trace_start, 0);
+    TRACE_BEGIN("lock held");
+    return;
+  }
+
+  TRACE_START(trace_start);
+  uint64_t start = stats_now();
+  int contended = region_mutex_trylock(&mutex->mutex) != 0;
+  int blocker_cmd = -1, blocker_line = 0;
+  if (contended) {
+    blocker_cmd = atomic_load_explicit(&mutex->owner_cmd, memory_order_relaxed);
+    blocker_line =
+        atomic_load_explicit(&mutex->owner_line, memory_order_relaxed);
+    region_mutex_lock(&mutex->mutex);
+  }
+  stats_lock_acquired(mutex, start);
+  TRACE_COMPLETE("lock wait", trace_start, contended);
+  TRACE_BEGIN("lock held");
+
+  mutex->acquisitions++;
+  if (contended) {
+    uint64_t wait = stats_now() - start;
+    mutex->contended++;
+    mutex->wait_ns += wait;
+    if (wait > mutex->max_wait_ns) {
+      mutex->max_wait_ns = wait;
+      mutex->blocker_cmd = blocker_cmd;
+      mutex->blocker_line = blocker_line;
+    }
+  }
+
+  int cmd, line;
+  stats_get_context(&cmd, &line);
+  atomic_store_explicit(&mutex->owner_cmd, cmd, memory_order_relaxed);
+  atomic_store_explicit(&mutex->owner_line, line, memory_order_relaxed);
+}
+
+void ems_mutex_unlock(struct EmsMutex *mutex) {
+  TRACE_END("lock held");
+  if (stats_enabled()) {
+    atomic_store_explicit(&mutex->owner_cmd, -1, memory_order_relaxed);
+    stats_lock_released(mutex);
+  }
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+static void report_mutex(FILE *out, const char *name, unsigned int id,
+                         const struct EmsMutex *mutex, int first) {
+  if (stats_json()) {
+    fprintf(out,
+            "%s\n    {\"lock\": \"%s\", \"id\": %u, \"acquisitions\": %lu, "
+            "\"contended\": %lu, \"wait_ns\": %llu, \"max_wait_ns\": %llu, "
+            "\"blocker\": \"%s\", \"blocker_line\": %d}",
+            first ? "" : ",", name, id, mutex->acquisitions, mutex->contended,
+            (unsigned long long)mutex->wait_ns,
+            (unsigned long long)mutex->max_wait_ns,
+            stats_command_name(mutex->blocker_cmd), mutex->blocker_line);
+  } else {
+    fprintf(out,
+            "  %-5s %-6u acquisitions=%lu contended=%lu wait=%llu "
+            "max_wait=%llu blocker=%s:%d\n",
+            name, id, mutex->acquisitions, mutex->contended,
+            (unsigned long long)mutex->wait_ns,
+            (unsigned long long)mutex->max_wait_ns,
+            stats_command_name(mutex->blocker_cmd), mutex->blocker_line);
+  }
+}
+
+void report_contention(struct EventList *list) {
+  if (!list || !stats_enabled()) {
+    return;
+  }
+
+  // Keeps the most contended events sorted by total wait time.
+  struct Event *top[REPORT_TOP_EVENTS];
+  size_t num_top = 0;
+  for (struct ListNode *current = list->head; current;
+       current = current->next) {
+    struct Event *event = current->event;
+    if (event->mutex.contended == 0) {
+      continue;
+    }
+
+    size_t i = num_top < REPORT_TOP_EVENTS ? num_top++ : REPORT_TOP_EVENTS;
+    while (i > 0 && top[i - 1]->mutex.wait_ns < event->mutex.wait_ns) {
+      if (i < REPORT_TOP_EVENTS) {
+        top[i] = top[i - 1];
+      }
+      i--;
+    }
+    if (i < REPORT_TOP_EVENTS) {
+      top[i] = event;
+    }
+  }
+
+  FILE *out = stats_output_open();
+  if (stats_json()) {
+    fprintf(out, "{\"pid\": %d, \"contention\": [", (int)getpid());
+  } else {
+    fprintf(out, "contention (pid %d), times in ns:\n", (int)getpid());
+  }
+  report_mutex(out, "list", 0, &list->mutex, 1);
+  for (size_t i = 0; i < num_top; i++) {
+    report_mutex(out, "event", top[i]->id, &top[i]->mutex, 0);
+  }
+  if (stats_json()) {
+    fprintf(out, "\n  ]}\n");
+  }
+  stats_output_close(out);
+}
+
+#endif // EMS_STATS
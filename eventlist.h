@@ -2,8 +2,84 @@
 #define EVENT_LIST_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
+#include "region.h"
+#include "stats.h"
+#include "trace.h"
+
+/// Mutex protecting the EMS state. When built with EMS_STATS it also records
+/// how often and for how long it was contended, and by whom.
+struct EmsMutex {
+  pthread_mutex_t mutex;
+#ifdef EMS_STATS
+  // Updated while holding the mutex.
+  unsigned long acquisitions; /// Number of times the mutex was acquired.
+  unsigned long contended;    /// Acquisitions that had to wait.
+  uint64_t wait_ns;           /// Total time spent waiting.
+  uint64_t max_wait_ns;       /// Longest wait.
+  int blocker_cmd;            /// Command holding the mutex on the longest wait.
+  int blocker_line;           /// Line of that command.
+  // Read without holding the mutex by the threads waiting for it.
+  _Atomic int owner_cmd;
+  _Atomic int owner_line;
+#endif
+};
+
+/// Seat indexes of a reservation. Buffers of cancelled reservations are kept
+/// in a free list of the event and reused by later reservations.
+struct SeatBuffer {
+  size_t capacity;         /// Number of seats the buffer can hold.
+  struct SeatBuffer *next; /// Next buffer in the free list.
+  size_t seats[];
+};
+
+/// Seats taken by a reservation.
+struct ReservationRecord {
+  size_t num_seats;          /// Number of seats reserved.
+  struct SeatBuffer *buffer; /// Seat indexes, NULL if cancelled.
+};
+
+/// Rows of a seat version in a chunk, one word of a row bitmap.
+#define SEAT_CHUNK_ROWS (8 * sizeof(unsigned long))
+
+/// Rows SEAT_CHUNK_ROWS * i to SEAT_CHUNK_ROWS * (i + 1) - 1 of a version.
+struct SeatChunk {
+  unsigned int *rows[SEAT_CHUNK_ROWS]; /// NULL past the last row.
+};
+
+/// Seats of an event as published by a writer. Readers load the version of
+/// an event once and read it without locking; writers copy the rows they
+/// changed into a new version and retire the old one, see epoch.h. The rows a
+/// write did not touch are shared with the previous version, and so are the
+/// chunks it did not touch, so a write copies one pointer per chunk.
+///
+/// The chunks are followed by a bitmap of the rows that the next version
+/// replaced, see seat_version_replaced, which is only set once the version
+/// is retired so that it is freed with the chunks and rows it owns.
+struct SeatVersion {
+  size_t num_rows;            /// Number of rows of the event.
+  struct SeatChunk *chunks[]; /// Reservation of each seat, row by row.
+};
+
+/// Gets the number of chunks of a version with the given number of rows.
+static inline size_t seat_version_chunks(size_t num_rows) {
+  return (num_rows + SEAT_CHUNK_ROWS - 1) / SEAT_CHUNK_ROWS;
+}
+
+/// Gets the bitmap of the rows of a version that the next one replaced.
+static inline unsigned long *
+seat_version_replaced(struct SeatVersion *version) {
+  return (unsigned long *)&version->chunks[seat_version_chunks(
+      version->num_rows)];
+}
+
+/// Frees a version along with every chunk and row it points to.
+/// @note Only for the last version of an event, the earlier ones share
+/// some of them.
+void free_seat_version(struct SeatVersion *version);
+
 struct Event {
   unsigned int id;           /// Event id
   unsigned int reservations; /// Number of reservations for the event.
@@ -14,21 +90,87 @@ struct Event {
   unsigned int
       *data; /// Array of size rows * cols with the reservations for each seat.
 
-  pthread_mutex_t mutex;
+  /// Last published copy of data, read by SHOW without the mutex.
+  _Atomic(struct SeatVersion *) version;
+  /// Bitmap of the rows of data changed since the version was published.
+  unsigned long *dirty_rows;
+  /// Set, under the event mutex, while data has changes that could not be
+  /// published. Read by SHOW without locking the event.
+  atomic_int stale;
+
+  /// Seats of every reservation, indexed by reservation id - 1.
+  struct ReservationRecord *records;
+  size_t records_capacity;          /// Number of records allocated.
+  struct SeatBuffer *free_buffers;  /// Buffers of cancelled reservations.
+  size_t num_free_buffers;          /// Number of buffers in the free list.
+
+  /// Set, under the event mutex, once the event is deleted. Readers that do
+  /// not lock the event read it too.
+  atomic_int deleted;
+
+  struct EmsMutex mutex;
 };
 
 struct ListNode {
   struct Event *event;
-  struct ListNode *next;
+  _Atomic(struct ListNode *) next;
 };
 
-// Linked list structure
+// Linked list structure. Readers traverse it without locks inside an epoch
+// critical section (see epoch.h), writers hold the mutex.
 struct EventList {
-  struct ListNode *head; // Head of the list
-  struct ListNode *tail; // Tail of the list
-  pthread_mutex_t mutex;
+  _Atomic(struct ListNode *) head; // Head of the list
+  struct ListNode *tail;           // Tail of the list
+  // Incremented before and after every node is linked or unlinked, so that
+  // readers can tell whether the list changed while they walked it.
+  atomic_ulong changes;
+  struct EmsMutex mutex;
 };
 
+#ifdef EMS_STATS
+
+/// Initializes a mutex.
+/// @return 0 if the mutex was initialized successfully, an error otherwise.
+int ems_mutex_init(struct EmsMutex *mutex);
+
+/// Locks a mutex, recording whether and for how long it was contended.
+void ems_mutex_lock(struct EmsMutex *mutex);
+
+/// Unlocks a mutex.
+void ems_mutex_unlock(struct EmsMutex *mutex);
+
+/// Writes the event list mutex and the most contended event mutexes to the
+/// statistics output.
+/// @param list Event list to report on.
+void report_contention(struct EventList *list);
+
+#else
+
+static inline int ems_mutex_init(struct EmsMutex *mutex) {
+  return region_mutex_init(&mutex->mutex);
+}
+
+static inline void ems_mutex_lock(struct EmsMutex *mutex) {
+  TRACE_START(start);
+  region_mutex_lock(&mutex->mutex);
+  TRACE_COMPLETE("lock wait", start, 0);
+  TRACE_BEGIN("lock held");
+}
+
+static inline void ems_mutex_unlock(struct EmsMutex *mutex) {
+  TRACE_END("lock held");
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+static inline void report_contention(struct EventList *list) { (void)list; }
+
+#endif // EMS_STATS
+
+/// Destroys a mutex.
+static inline void ems_mutex_destroy(struct EmsMutex *mutex) {
+  pthread_mutex_destroy(&mutex->mutex);
+}
+
 /// Creates a new event list.
 /// @return Newly created event list, NULL on failure
 struct EventList *create_list();
@@ -39,12 +181,22 @@ struct EventList *create_list();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int append_to_list(struct EventList *list, struct Event *data);
 
+/// Unlinks the node of an event from the list and retires it, so that it is
+/// freed once no reader can reference it anymore.
+/// @note The caller must hold the list mutex.
+/// @param list Event list to be modified.
+/// @param event Event to be removed.
+/// @return 0 if the node was removed successfully, 1 otherwise.
+int remove_from_list(struct EventList *list, struct Event *event);
+
 /// Removes a node from the list.
 /// @param list Event list to be modified.
 /// @return 0 if the node was removed successfully, 1 otherwise.
 void free_list(struct EventList *list);
 
 /// Retrieves an event in the list.
+/// @note The caller must hold the list mutex or be inside an epoch critical
+/// section.
 /// @param list Event list to be searched
 /// @param event_id Event id.
 /// @return Pointer to the event if found, NULL otherwise.
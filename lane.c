@@ -0,0 +1,308 @@
+#include "lane.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "collector.h"
+#include "stats.h"
+#include "trace.h"
+
+/// A read waiting in the lane or being run.
+struct LaneItem {
+  enum Command cmd;
+  unsigned int event_id;
+  int line;
+  uint64_t deferred; /// When the read was deferred, in ns.
+  struct LaneItem *next;
+};
+
+struct ReadLane {
+  pthread_mutex_t mutex;
+  pthread_cond_t ready; /// Signaled when a read is deferred or on stop.
+  /// Signaled when a read is deferred to an empty lane or on stop. Waits on
+  /// CLOCK_MONOTONIC, as now_ns.
+  pthread_cond_t late;
+  pthread_cond_t done; /// Broadcast whenever a read has run.
+  struct LaneItem *head; /// Reads waiting, oldest first.
+  struct LaneItem *tail;
+  struct LaneItem *active; /// Reads being run, by the lane or by a thread.
+  int stop;
+  /// Reads waiting or being run. Lets the writes skip the mutex when there
+  /// are none.
+  atomic_int pending;
+  uint64_t deadline_ns;
+  struct OutputCollector *collector;
+  int fd_out;
+  int thread_id;
+  pthread_t thread;      /// Runs the reads in order.
+  pthread_t late_thread; /// Runs the reads past their deadline.
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// Moves a waiting read to the active ones.
+/// @param prev Read before it in the queue, NULL if it is the head.
+/// @note The mutex must be held.
+static void take(struct ReadLane *lane, struct LaneItem *prev,
+                 struct LaneItem *item) {
+  if (prev == NULL) {
+    lane->head = item->next;
+  } else {
+    prev->next = item->next;
+  }
+  if (lane->tail == item) {
+    lane->tail = prev;
+  }
+  item->next = lane->active;
+  lane->active = item;
+}
+
+/// Runs a read taken with take and frees it.
+/// @note The mutex must not be held.
+static void run(struct ReadLane *lane, struct LaneItem *item) {
+  TRACE_START(trace_start);
+  STATS_SET_CONTEXT(item->cmd, item->line);
+  struct Request req = {.cmd = item->cmd, .event_id = item->event_id};
+  execute_collected(&req, item->line, lane->fd_out, lane->collector);
+  // The latency of a read includes the time it waited in the lane.
+  STATS_RECORD_COMMAND(item->cmd, 1, item->deferred);
+  TRACE_COMPLETE(command_name(item->cmd), trace_start, item->line);
+
+  pthread_mutex_lock(&lane->mutex);
+  struct LaneItem **link = &lane->active;
+  while (*link != item) {
+    link = &(*link)->next;
+  }
+  *link = item->next;
+  atomic_fetch_sub(&lane->pending, 1);
+  pthread_cond_broadcast(&lane->done);
+  pthread_mutex_unlock(&lane->mutex);
+  free(item);
+}
+
+/// Tells whether a write changes what a read would output.
+static int conflicts(const struct LaneItem *item, const struct Request *req) {
+  switch (req->cmd) {
+  case CMD_CREATE:
+  case CMD_DELETE:
+    return item->cmd == CMD_LIST_EVENTS || item->event_id == req->event_id;
+  case CMD_RESERVE:
+  case CMD_CANCEL:
+    return item->cmd == CMD_SHOW && item->event_id == req->event_id;
+  case CMD_BATCH:
+  case CMD_TXN:
+    if (item->cmd != CMD_SHOW) {
+      return 0;
+    }
+    for (size_t i = 0; i < req->batch->num_reservations; i++) {
+      if (req->batch->reservations[i].event_id == item->event_id) {
+        return 1;
+      }
+    }
+    return 0;
+  case CMD_SHOW:
+  case CMD_LIST_EVENTS:
+  case CMD_WAIT:
+  case CMD_BARRIER:
+  case CMD_END:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    return 0;
+  }
+  return 0;
+}
+
+static void *lane_thread(void *arg) {
+  struct ReadLane *lane = arg;
+  STATS_SET_THREAD(lane->thread_id);
+  TRACE_THREAD(lane->thread_id);
+  pthread_mutex_lock(&lane->mutex);
+  while (1) {
+    while (lane->head == NULL && !lane->stop) {
+      pthread_cond_wait(&lane->ready, &lane->mutex);
+    }
+    if (lane->head == NULL) {
+      break;
+    }
+    struct LaneItem *item = lane->head;
+    take(lane, NULL, item);
+    pthread_mutex_unlock(&lane->mutex);
+    run(lane, item);
+    pthread_mutex_lock(&lane->mutex);
+  }
+  pthread_mutex_unlock(&lane->mutex);
+  return NULL;
+}
+
+/// Runs the oldest waiting read once it is past its deadline, while the lane
+/// thread is still busy with the reads before it.
+static void *late_thread(void *arg) {
+  struct ReadLane *lane = arg;
+  STATS_SET_THREAD(lane->thread_id + 1);
+  TRACE_THREAD(lane->thread_id + 1);
+  pthread_mutex_lock(&lane->mutex);
+  while (!lane->stop) {
+    struct LaneItem *item = lane->head;
+    if (item == NULL) {
+      pthread_cond_wait(&lane->late, &lane->mutex);
+      continue;
+    }
+    uint64_t due = item->deferred + lane->deadline_ns;
+    if (now_ns() < due) {
+      struct timespec until = {.tv_sec = (time_t)(due / 1000000000u),
+                               .tv_nsec = (long)(due % 1000000000u)};
+      pthread_cond_timedwait(&lane->late, &lane->mutex, &until);
+      continue;
+    }
+    take(lane, NULL, item);
+    pthread_mutex_unlock(&lane->mutex);
+    run(lane, item);
+    pthread_mutex_lock(&lane->mutex);
+  }
+  pthread_mutex_unlock(&lane->mutex);
+  return NULL;
+}
+
+/// Stops the threads of a lane and waits for them.
+static void stop_threads(struct ReadLane *lane, int late) {
+  pthread_mutex_lock(&lane->mutex);
+  lane->stop = 1;
+  pthread_cond_signal(&lane->ready);
+  pthread_cond_signal(&lane->late);
+  pthread_mutex_unlock(&lane->mutex);
+  pthread_join(lane->thread, NULL);
+  if (late) {
+    pthread_join(lane->late_thread, NULL);
+  }
+}
+
+static void destroy_sync(struct ReadLane *lane) {
+  pthread_cond_destroy(&lane->done);
+  pthread_cond_destroy(&lane->late);
+  pthread_cond_destroy(&lane->ready);
+  pthread_mutex_destroy(&lane->mutex);
+}
+
+struct ReadLane *lane_create(struct OutputCollector *collector, int fd_out,
+                             unsigned int deadline_ms, int thread_id) {
+  struct ReadLane *lane = calloc(1, sizeof(struct ReadLane));
+  if (lane == NULL) {
+    fprintf(stderr, "Failed to allocate read lane\n");
+    return NULL;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&lane->mutex, NULL);
+  pthread_cond_init(&lane->ready, NULL);
+  pthread_cond_init(&lane->late, &attr);
+  pthread_cond_init(&lane->done, NULL);
+  pthread_condattr_destroy(&attr);
+  atomic_init(&lane->pending, 0);
+  lane->deadline_ns = (uint64_t)deadline_ms * 1000000u;
+  lane->collector = collector;
+  lane->fd_out = fd_out;
+  lane->thread_id = thread_id;
+  if (pthread_create(&lane->thread, NULL, lane_thread, lane) != 0) {
+    fprintf(stderr, "Failed to start read lane\n");
+    destroy_sync(lane);
+    free(lane);
+    return NULL;
+  }
+  if (pthread_create(&lane->late_thread, NULL, late_thread, lane) != 0) {
+    fprintf(stderr, "Failed to start read lane\n");
+    stop_threads(lane, 0);
+    destroy_sync(lane);
+    free(lane);
+    return NULL;
+  }
+  return lane;
+}
+
+void lane_destroy(struct ReadLane *lane) {
+  stop_threads(lane, 1);
+  destroy_sync(lane);
+  free(lane);
+}
+
+int lane_is_read(enum Command cmd) {
+  return cmd == CMD_SHOW || cmd == CMD_LIST_EVENTS;
+}
+
+int lane_defer(struct ReadLane *lane, const struct Request *req, int line) {
+  struct LaneItem *item = malloc(sizeof(struct LaneItem));
+  if (item == NULL) {
+    return 1;
+  }
+  item->cmd = req->cmd;
+  item->event_id = req->event_id;
+  item->line = line;
+  item->deferred = now_ns();
+  item->next = NULL;
+
+  pthread_mutex_lock(&lane->mutex);
+  if (lane->tail == NULL) {
+    lane->head = item;
+    pthread_cond_signal(&lane->late);
+  } else {
+    lane->tail->next = item;
+  }
+  lane->tail = item;
+  atomic_fetch_add(&lane->pending, 1);
+  pthread_cond_signal(&lane->ready);
+  pthread_mutex_unlock(&lane->mutex);
+  return 0;
+}
+
+void lane_order(struct ReadLane *lane, const struct Request *req) {
+  if (atomic_load(&lane->pending) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&lane->mutex);
+  while (1) {
+    int running = 0;
+    for (struct LaneItem *item = lane->active; item != NULL;
+         item = item->next) {
+      running |= conflicts(item, req);
+    }
+    if (running) {
+      pthread_cond_wait(&lane->done, &lane->mutex);
+      continue;
+    }
+
+    struct LaneItem *prev = NULL;
+    struct LaneItem *item = lane->head;
+    while (item != NULL && !conflicts(item, req)) {
+      prev = item;
+      item = item->next;
+    }
+    if (item == NULL) {
+      break;
+    }
+    take(lane, prev, item);
+    pthread_mutex_unlock(&lane->mutex);
+    run(lane, item);
+    pthread_mutex_lock(&lane->mutex);
+  }
+  pthread_mutex_unlock(&lane->mutex);
+}
+
+void lane_drain(struct ReadLane *lane) {
+  pthread_mutex_lock(&lane->mutex);
+  while (lane->head != NULL || lane->active != NULL) {
+    pthread_cond_wait(&lane->done, &lane->mutex);
+  }
+  pthread_mutex_unlock(&lane->mutex);
+}
@@ -0,0 +1,50 @@
+#ifndef EMS_LANE_H
+#define EMS_LANE_H
+
+#include "aux.h"
+
+/// Background lane for the long reads of a job file, SHOW and LIST.
+///
+/// With the priority scheduler, the threads of a job file run the writes
+/// they own right away and hand their reads to the lane, whose thread runs
+/// them in the order they were deferred. A read waiting for longer than its
+/// deadline is run by a second lane thread, ahead of the one the first thread
+/// is busy with, so that reports are late but never starved and the threads
+/// of the job file never stop writing for them. A write that would change the
+/// output of a deferred read runs it, or waits for it, first, so that every
+/// read still shows the state as of its own line and goes to its own line of
+/// the output collector.
+struct ReadLane;
+
+/// Creates a lane and starts its threads.
+/// @param collector Collector the output of the reads goes to.
+/// @param fd_out File descriptor the reads would write to.
+/// @param deadline_ms Longest a read waits before the second thread runs it.
+/// @param thread_id Id the lane thread reports in the stats and trace. The
+/// second thread reports the next one.
+/// @return The lane, NULL on failure.
+struct ReadLane *lane_create(struct OutputCollector *collector, int fd_out,
+                             unsigned int deadline_ms, int thread_id);
+
+/// Stops the threads of a lane and destroys it.
+/// @note lane_drain must be called first.
+void lane_destroy(struct ReadLane *lane);
+
+/// Tells whether a command is a read the lane runs.
+int lane_is_read(enum Command cmd);
+
+/// Defers a read to the lane.
+/// @param req SHOW or LIST to run.
+/// @param line Line of the command.
+/// @return 0 if the read was deferred, 1 if the caller must run it.
+int lane_defer(struct ReadLane *lane, const struct Request *req, int line);
+
+/// Runs, or waits for, the deferred reads whose output a write would change.
+/// Called before executing the write.
+/// @param req Command about to be executed.
+void lane_order(struct ReadLane *lane, const struct Request *req);
+
+/// Waits until every deferred read has run, e.g. at a BARRIER.
+void lane_drain(struct ReadLane *lane);
+
+#endif // EMS_LANE_H
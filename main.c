@@ -1,6 +1,5 @@
 #include <dirent.h>
 #include <fcntl.h>
-#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,40 +7,178 @@
 #include <unistd.h>
 
 #include "aux.h"
+#include "config.h"
 #include "constants.h"
+#include "epoch.h"
 #include "operations.h"
 #include "parser.h"
+#include "region.h"
+#include "server.h"
+#include "shard.h"
+#include "stream.h"
+#include "trace.h"
+
+/// Most settings that can be given on the command line.
+#define MAX_OVERRIDES 32
+/// Longest "key=value" setting that can be given on the command line.
+#define MAX_OVERRIDE_LENGTH 128
+
+/// Adds a setting given on the command line.
+/// @param key Name of the setting, NULL if value is a "key=value" pair.
+/// @return 0 on success, 1 if there are too many settings or it is too long.
+static int add_override(char overrides[][MAX_OVERRIDE_LENGTH],
+                        int *num_overrides, const char *key,
+                        const char *value) {
+  if (*num_overrides == MAX_OVERRIDES) {
+    fprintf(stderr, "Too many settings\n");
+    return 1;
+  }
+  char *override = overrides[*num_overrides];
+  int len = key != NULL
+                ? snprintf(override, MAX_OVERRIDE_LENGTH, "%s=%s", key, value)
+                : snprintf(override, MAX_OVERRIDE_LENGTH, "%s", value);
+  if (len < 0 || len >= MAX_OVERRIDE_LENGTH) {
+    fprintf(stderr, "Setting too long: %s%s%s\n", key != NULL ? key : "",
+            key != NULL ? "=" : "", value);
+    return 1;
+  }
+  (*num_overrides)++;
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
-  unsigned int state_access_delay_ms = STATE_ACCESS_DELAY_MS;
-  int max_procs = MAX_PROC;
-  int max_threads = MAX_THREADS;
+  struct EmsConfig *config = config_get();
+  const char *config_path = getenv("EMS_CONFIG");
+  const char *socket_path = NULL;
+  const char *stream_path = NULL;
+  // Settings given on the command line, applied after the config file and
+  // the environment.
+  char overrides[MAX_OVERRIDES][MAX_OVERRIDE_LENGTH];
+  int num_overrides = 0;
+  TRACE_THREAD(-1);
 
-  if (argc > 4) {
-    char *endptr;
-    unsigned long int delay = strtoul(argv[4], &endptr, 10);
+  int opt;
+  while ((opt = getopt(argc, argv, "ac:i:m:o:Ps:S:")) != -1) {
+    switch (opt) {
+    case 'a':
+      if (add_override(overrides, &num_overrides, "adaptive", "1") != 0) {
+        return 1;
+      }
+      break;
+    case 'c':
+      config_path = optarg;
+      break;
+    case 'i':
+      stream_path = optarg;
+      break;
+    case 'm':
+      if (add_override(overrides, &num_overrides, "shared_mb", optarg) != 0) {
+        return 1;
+      }
+      break;
+    case 'o':
+      if (add_override(overrides, &num_overrides, NULL, optarg) != 0) {
+        return 1;
+      }
+      break;
+    case 'P':
+      if (add_override(overrides, &num_overrides, "priority", "1") != 0) {
+        return 1;
+      }
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'S':
+      if (add_override(overrides, &num_overrides, "shards", optarg) != 0) {
+        return 1;
+      }
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-a] [-P] [-c config] [-o key=value] [-m shared_mb] "
+              "[-S shards] <jobs_dir> [procs] [threads] [delay]\n"
+              "       %s [-c config] [-o key=value] -s <socket> [threads] "
+              "[delay]\n"
+              "       %s [-c config] [-o key=value] -i <stream|-> [threads] "
+              "[delay]\n",
+              argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  }
+  // The positional arguments keep their indexes after the options.
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  // The positional arguments take precedence over everything else.
+  static const char *job_args[] = {NULL, "procs", "threads", "delay"};
+  // The server and the stream run a single pool of threads.
+  static const char *pool_args[] = {"threads", "delay"};
+  int pooled = socket_path != NULL || stream_path != NULL;
+  const char **names = pooled ? pool_args : job_args;
+  int num_names = pooled ? 2 : 4;
+  for (int i = 1; i < argc && i <= num_names; i++) {
+    if (names[i - 1] == NULL) {
+      continue;
+    }
+    if (add_override(overrides, &num_overrides, names[i - 1], argv[i]) != 0) {
+      return 1;
+    }
+  }
 
-    if (*endptr != '\0' || delay > UINT_MAX) {
-      fprintf(stderr, "Invalid delay value or value too large\n");
+  if ((config_path != NULL && config_load_file(config, config_path) != 0) ||
+      config_load_env(config) != 0) {
+    return 1;
+  }
+  for (int i = 0; i < num_overrides; i++) {
+    if (config_set_pair(config, overrides[i]) != 0) {
       return 1;
     }
+  }
 
-    state_access_delay_ms = (unsigned int)delay;
+  unsigned int state_access_delay_ms = (unsigned int)config->delay;
+  int max_procs = (int)config->procs;
+  int max_threads = (int)config->threads;
+  int num_shards = (int)config->shards;
+  size_t shared_mb = (size_t)config->shared_mb;
+  int adaptive_max_threads = 0;
+  if (config->adaptive) {
+    unsigned long limit = config->adaptive_max_threads;
+    if (limit == 0) {
+      limit = 4 * config_num_cpus();
+    }
+    adaptive_max_threads =
+        (int)(limit < MAX_THREADS_LIMIT ? limit : MAX_THREADS_LIMIT);
   }
 
-  if (argc > 3) {
-    max_threads = atoi(argv[3]);
-    if (max_threads > INT_MAX) {
-      fprintf(stderr, "Invalid max threads value or value too large\n");
+  if (socket_path != NULL) {
+    if (shared_mb > 0) {
+      fprintf(stderr, "Shared state only applies to job directories\n");
       return 1;
     }
+    return run_server(socket_path, max_threads, state_access_delay_ms);
   }
 
-  if (argc > 2) {
-    max_procs = atoi(argv[2]);
+  if (stream_path != NULL) {
+    if (shared_mb > 0 || num_shards > 0) {
+      fprintf(stderr,
+              "Shared state and shards only apply to job directories\n");
+      return 1;
+    }
+    return execute_stream(stream_path, STDOUT_FILENO, state_access_delay_ms,
+                          max_threads);
+  }
 
-    if (max_procs > INT_MAX) {
-      fprintf(stderr, "Invalid max process value or value too large\n");
+  // Every job file is executed against one state that the children inherit,
+  // instead of each one building its own.
+  if (shared_mb > 0 && argc > 1) {
+    if (num_shards > 0) {
+      fprintf(stderr, "Shared state and shards cannot be combined\n");
+      return 1;
+    }
+    if (region_create(shared_mb * 1024 * 1024) != 0 || epoch_share() != 0 ||
+        ems_init(state_access_delay_ms) != 0) {
       return 1;
     }
   }
@@ -57,30 +194,72 @@ int main(int argc, char *argv[]) {
       if ((fileptr = readdir(jobs_dir)) != NULL) {
         if (strstr(fileptr->d_name, INPUT_EXTENSION) != NULL) {
           if (active_procs == max_procs) {
+            TRACE_START(wait_start);
             child_pid = wait(&status);
+            TRACE_COMPLETE("wait", wait_start, child_pid);
             printf("Process %d terminated with status %d\n", child_pid, status);
+            if (shared_mb > 0) {
+              epoch_forget(child_pid);
+            }
             active_procs--;
           }
           active_procs++;
+          TRACE_START(fork_start);
           pid = fork();
           if (pid == 0) {
+            TRACE_RESET();
             char filein[1024];
             sprintf(filein, "%s/%s", argv[1], fileptr->d_name);
             int fd_out = create_output_file(fileptr->d_name, argv[1]);
 
-            execute_file(filein, fd_out, state_access_delay_ms, max_threads);
+            int result = 0;
+            if (num_shards > 0) {
+              result = execute_file_sharded(filein, fd_out,
+                                            state_access_delay_ms, max_threads,
+                                            num_shards);
+            } else {
+              execute_file(filein, fd_out, state_access_delay_ms, max_threads,
+                           adaptive_max_threads);
+            }
             close(fd_out);
-            exit(0);
+            exit(result);
           }
+          TRACE_COMPLETE("fork", fork_start, pid);
         }
       } else
         break;
     }
     while (active_procs > 0) {
+      TRACE_START(wait_start);
       child_pid = wait(&status);
+      TRACE_COMPLETE("wait", wait_start, child_pid);
       printf("Process %d terminated with status %d\n", child_pid, status);
+      if (shared_mb > 0) {
+        epoch_forget(child_pid);
+      }
       active_procs--;
     }
     closedir(jobs_dir);
+
+    int lost = 0;
+    if (shared_mb > 0) {
+      // A state left half changed is not walked to be freed, it goes with
+      // the region.
+      lost = region_poisoned();
+      if (!lost) {
+        ems_terminate();
+      }
+      region_destroy();
+    }
+
+#ifdef EMS_TRACE
+    char trace_path[1024];
+    snprintf(trace_path, sizeof(trace_path), "%s/ems.trace.json", argv[1]);
+    TRACE_FLUSH(trace_path);
+#endif
+    if (lost) {
+      fprintf(stderr, "Shared state lost, the output cannot be trusted\n");
+      return 1;
+    }
   }
 }
@@ -1,17 +1,29 @@
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "aux.h"
+#include "constants.h"
+#include "epoch.h"
 #include "eventlist.h"
 #include "operations.h"
 #include "parser.h"
+#include "region.h"
+#include "stats.h"
+#include "trace.h"
+
+/// Bits in a word of the dirty rows bitmap of an event.
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
 
 static struct EventList *event_list = NULL;
 static unsigned int state_access_delay_ms = 0;
+/// Number of ems_init calls of this process that attached to a state shared
+/// by its parent, each one matched by an ems_terminate that leaves it alone.
+static unsigned int shared_users = 0;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -20,31 +32,80 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Waits to simulate a real system accessing a costly memory resource.
+static void access_delay(void) {
+  STATS_START(start);
+  TRACE_START(trace_start);
+  struct timespec delay = delay_to_timespec(state_access_delay_ms);
+  nanosleep(&delay, NULL); // Should not be removed
+  STATS_RECORD(STATS_DELAY, start);
+  TRACE_COMPLETE("delay", trace_start, 0);
+}
+
 /// Gets the event with the given ID from the state.
 /// @note Will wait to simulate a real system accessing a costly memory
-/// resource.
+/// resource. The caller must hold the list mutex or be inside an epoch
+/// critical section.
 /// @param event_id The ID of the event to get.
 /// @return Pointer to the event if found, NULL otherwise.
 static struct Event *get_event_with_delay(unsigned int event_id) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL); // Should not be removed
-
+  access_delay();
   return get_event(event_list, event_id);
 }
 
 /// Gets the seat with the given index from the state.
 /// @note Will wait to simulate a real system accessing a costly memory
-/// resource.
+/// resource. The caller must hold the event mutex, and call mark_dirty
+/// before changing the seat.
 /// @param event Event to get the seat from.
 /// @param index Index of the seat to get.
 /// @return Pointer to the seat.
 static unsigned int *get_seat_with_delay(struct Event *event, size_t index) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL); // Should not be removed
-
+  access_delay();
   return &event->data[index];
 }
 
+/// Marks the row of a seat as changed, so that unlock_event publishes it.
+/// @note The caller must hold the event mutex.
+/// @param index Index of the seat about to be changed.
+static void mark_dirty(struct Event *event, size_t index) {
+  size_t row = index / event->cols;
+  event->dirty_rows[row / BITS_PER_WORD] |= 1UL << (row % BITS_PER_WORD);
+}
+
+/// Frees a retired version along with the chunks and rows the next version
+/// replaced.
+static void free_version(void *data) {
+  struct SeatVersion *version = (struct SeatVersion *)data;
+  const unsigned long *replaced = seat_version_replaced(version);
+  size_t num_chunks = seat_version_chunks(version->num_rows);
+  for (size_t i = 0; i < num_chunks; i++) {
+    if (replaced[i] == 0) {
+      continue;
+    }
+    for (size_t j = 0; j < SEAT_CHUNK_ROWS; j++) {
+      if (replaced[i] & 1UL << j) {
+        region_free(version->chunks[i]->rows[j]);
+      }
+    }
+    region_free(version->chunks[i]);
+  }
+  region_free(version);
+}
+
+/// Gets a seat from a published version of an event.
+/// @note Will wait to simulate a real system accessing a costly memory
+/// resource.
+/// @param row Row of the seat, starting at 1.
+/// @param col Column of the seat, starting at 1.
+/// @return Reservation of the seat, 0 if free.
+static unsigned int get_published_seat_with_delay(
+    const struct SeatVersion *version, size_t row, size_t col) {
+  access_delay();
+  const struct SeatChunk *chunk = version->chunks[(row - 1) / SEAT_CHUNK_ROWS];
+  return chunk->rows[(row - 1) % SEAT_CHUNK_ROWS][col - 1];
+}
+
 /// Gets the index of a seat.
 /// @note This function assumes that the seat exists.
 /// @param event Event to get the seat index from.
@@ -55,7 +116,157 @@ static size_t seat_index(struct Event *event, size_t row, size_t col) {
   return (row - 1) * event->cols + col - 1;
 }
 
+/// Frees the chunks and rows of a version being published that it does not
+/// share with the old one, then the version.
+/// @param num_chunks Number of chunks of the version set so far.
+static void discard_version(struct SeatVersion *version,
+                            const struct SeatVersion *old, size_t num_chunks) {
+  for (size_t i = 0; i < num_chunks; i++) {
+    struct SeatChunk *chunk = version->chunks[i];
+    if (chunk == NULL || (old != NULL && chunk == old->chunks[i])) {
+      continue;
+    }
+    for (size_t j = 0; j < SEAT_CHUNK_ROWS; j++) {
+      if (old == NULL || chunk->rows[j] != old->chunks[i]->rows[j]) {
+        region_free(chunk->rows[j]);
+      }
+    }
+    region_free(chunk);
+  }
+  region_free(version);
+}
+
+/// Publishes a new version of the seats of an event with a copy of the rows
+/// changed since the last one, then retires the old version along with the
+/// chunks and rows it replaces.
+/// @note The caller must hold the event mutex.
+/// @return 0 if the version was published or nothing changed, 1 if it could
+/// not be allocated, in which case the changes are published by the next
+/// call.
+static int publish_seats(struct Event *event) {
+  // Every word of the bitmap is the rows of a chunk.
+  size_t words = seat_version_chunks(event->rows);
+  unsigned long dirty = 0;
+  for (size_t i = 0; i < words; i++) {
+    dirty |= event->dirty_rows[i];
+  }
+  if (dirty == 0) {
+    return 0;
+  }
+
+  struct SeatVersion *old =
+      atomic_load_explicit(&event->version, memory_order_relaxed);
+  struct SeatVersion *version = region_alloc(
+      sizeof(struct SeatVersion) + words * sizeof(struct SeatChunk *) +
+      words * sizeof(unsigned long));
+  if (version == NULL) {
+    fprintf(stderr, "Error allocating memory for seat version\n");
+    return 1;
+  }
+  version->num_rows = event->rows;
+
+  size_t row_size = event->cols * sizeof(unsigned int);
+  for (size_t i = 0; i < words; i++) {
+    if (event->dirty_rows[i] == 0) {
+      version->chunks[i] = old->chunks[i];
+      continue;
+    }
+
+    struct SeatChunk *chunk = region_alloc(sizeof(struct SeatChunk));
+    version->chunks[i] = chunk;
+    if (chunk == NULL) {
+      fprintf(stderr, "Error allocating memory for seat version\n");
+      discard_version(version, old, i);
+      return 1;
+    }
+    if (old != NULL) {
+      *chunk = *old->chunks[i];
+    } else {
+      memset(chunk, 0, sizeof(struct SeatChunk));
+    }
+
+    for (size_t j = 0; j < SEAT_CHUNK_ROWS; j++) {
+      size_t row = i * SEAT_CHUNK_ROWS + j;
+      if (row == event->rows) {
+        break;
+      }
+      if (!(event->dirty_rows[i] & 1UL << j)) {
+        continue;
+      }
+      chunk->rows[j] = region_alloc(row_size);
+      if (chunk->rows[j] == NULL) {
+        fprintf(stderr, "Error allocating memory for seat version\n");
+        discard_version(version, old, i + 1);
+        return 1;
+      }
+      memcpy(chunk->rows[j], &event->data[row * event->cols], row_size);
+    }
+  }
+
+  // Readers that loaded the old version keep it until they leave their
+  // epoch critical section.
+  atomic_store_explicit(&event->version, version, memory_order_release);
+  if (old != NULL) {
+    // Readers never look past the chunks, so the old version can still be
+    // told which of its rows went away.
+    memcpy(seat_version_replaced(old), event->dirty_rows,
+           words * sizeof(unsigned long));
+    epoch_retire(old, free_version);
+  }
+  memset(event->dirty_rows, 0, words * sizeof(unsigned long));
+  return 0;
+}
+
+/// Publishes the seats changed by the caller and unlocks an event.
+/// @note If they cannot be published, SHOW reads them under the mutex until
+/// they are.
+static void unlock_event(struct Event *event) {
+  atomic_store_explicit(&event->stale, publish_seats(event) != 0,
+                        memory_order_release);
+  ems_mutex_unlock(&event->mutex);
+}
+
+/// Checks that the state can be used, reporting why not on stderr.
+/// @return 0 if it can, 1 otherwise.
+static int check_state(void) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
+  }
+  if (region_poisoned()) {
+    fprintf(stderr, "EMS state is lost\n");
+    return 1;
+  }
+  return 0;
+}
+
+/// Gets the event with the given ID and locks it.
+/// @note The caller must be inside an epoch critical section.
+/// @param event_id The ID of the event to get.
+/// @return Pointer to the locked event if found and not deleted, NULL
+/// otherwise.
+static struct Event *lock_event(unsigned int event_id) {
+  struct Event *event = get_event_with_delay(event_id);
+  if (event == NULL) {
+    return NULL;
+  }
+
+  ems_mutex_lock(&event->mutex);
+  // Its previous owner may have died halfway through changing it.
+  if (event->deleted || region_poisoned()) {
+    ems_mutex_unlock(&event->mutex);
+    return NULL;
+  }
+  return event;
+}
+
 int ems_init(unsigned int delay_ms) {
+  if (event_list != NULL && region_shared()) {
+    // Inherited from the process that created the shared region.
+    shared_users++;
+    state_access_delay_ms = delay_ms;
+    return 0;
+  }
   if (event_list != NULL) {
     fprintf(stderr, "EMS state has already been initialized\n");
     return 1;
@@ -72,81 +283,159 @@ int ems_terminate() {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
-  pthread_mutex_destroy(&event_list->mutex);
+  if (shared_users > 0) {
+    // The state is torn down by the process that created it.
+    shared_users--;
+    return 0;
+  }
+  report_contention(event_list);
+  ems_mutex_destroy(&event_list->mutex);
   free_list(event_list);
+  epoch_drain();
+  event_list = NULL;
   return 0;
 }
 
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
-  if (event_list == NULL) {
-    fprintf(stderr, "EMS state must be initialized\n");
+  if (check_state() != 0) {
     return 1;
   }
 
-  pthread_mutex_lock(&event_list->mutex);
+  ems_mutex_lock(&event_list->mutex);
 
   if (get_event_with_delay(event_id) != NULL) {
     fprintf(stderr, "Event already exists\n");
-    pthread_mutex_unlock(&event_list->mutex);
+    ems_mutex_unlock(&event_list->mutex);
     return 1;
   }
 
-  struct Event *event = malloc(sizeof(struct Event));
+  struct Event *event = region_alloc(sizeof(struct Event));
 
   if (event == NULL) {
     fprintf(stderr, "Error allocating memory for event\n");
-    pthread_mutex_unlock(&event_list->mutex);
+    ems_mutex_unlock(&event_list->mutex);
     return 1;
   }
 
-  pthread_mutex_init(&event->mutex, NULL);
-  pthread_mutex_lock(&event->mutex);
+  ems_mutex_init(&event->mutex);
+  ems_mutex_lock(&event->mutex);
   event->id = event_id;
   event->rows = num_rows;
   event->cols = num_cols;
   event->reservations = 0;
-  event->data = malloc(num_rows * num_cols * sizeof(unsigned int));
+  event->records = NULL;
+  event->records_capacity = 0;
+  event->free_buffers = NULL;
+  event->num_free_buffers = 0;
+  event->deleted = 0;
+  event->data = region_alloc(num_rows * num_cols * sizeof(unsigned int));
+  size_t words = (num_rows + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  event->dirty_rows = region_alloc(words * sizeof(unsigned long));
+  atomic_init(&event->version, NULL);
+  atomic_init(&event->stale, 0);
 
-  if (event->data == NULL) {
+  if (event->data == NULL || event->dirty_rows == NULL) {
     fprintf(stderr, "Error allocating memory for event data\n");
-    pthread_mutex_unlock(&event->mutex);
-    free(event);
+    region_free(event->dirty_rows);
+    region_free(event->data);
+    ems_mutex_unlock(&event->mutex);
+    region_free(event);
+    ems_mutex_unlock(&event_list->mutex);
     return 1;
   }
 
   for (size_t i = 0; i < num_rows * num_cols; i++) {
     event->data[i] = 0;
   }
+  // The first version has every row.
+  memset(event->dirty_rows, 0xff, words * sizeof(unsigned long));
 
-  if (append_to_list(event_list, event) != 0) {
+  if (publish_seats(event) != 0 || append_to_list(event_list, event) != 0) {
     fprintf(stderr, "Error appending event to list\n");
-    free(event->data);
-    pthread_mutex_unlock(&event->mutex);
-    free(event);
+    free_seat_version(atomic_load(&event->version));
+    region_free(event->dirty_rows);
+    region_free(event->data);
+    ems_mutex_unlock(&event->mutex);
+    region_free(event);
+    ems_mutex_unlock(&event_list->mutex);
     return 1;
   }
-  pthread_mutex_unlock(&event->mutex);
-  pthread_mutex_unlock(&event_list->mutex);
+  ems_mutex_unlock(&event->mutex);
+  ems_mutex_unlock(&event_list->mutex);
   return 0;
 }
 
-int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs,
-                size_t *ys) {
-  if (event_list == NULL) {
-    fprintf(stderr, "EMS state must be initialized\n");
-    return 1;
+/// Takes a seat buffer for num_seats seats, reusing one of a cancelled
+/// reservation when possible.
+/// @note The caller must hold the event mutex.
+/// @return The buffer, NULL on failure.
+static struct SeatBuffer *take_seat_buffer(struct Event *event,
+                                           size_t num_seats) {
+  struct SeatBuffer **link = &event->free_buffers;
+  while (*link != NULL) {
+    if ((*link)->capacity >= num_seats) {
+      struct SeatBuffer *buffer = *link;
+      *link = buffer->next;
+      event->num_free_buffers--;
+      return buffer;
+    }
+    link = &(*link)->next;
   }
 
-  pthread_mutex_lock(&event_list->mutex);
+  struct SeatBuffer *buffer =
+      region_alloc(sizeof(struct SeatBuffer) + num_seats * sizeof(size_t));
+  if (buffer != NULL) {
+    buffer->capacity = num_seats;
+  }
+  return buffer;
+}
 
-  struct Event *event = get_event_with_delay(event_id);
-  if (event == NULL) {
-    fprintf(stderr, "Event not found\n");
-    pthread_mutex_unlock(&event_list->mutex);
-    return 1;
+/// Returns a seat buffer to the free list of the event.
+/// @note The caller must hold the event mutex.
+static void give_seat_buffer(struct Event *event, struct SeatBuffer *buffer) {
+  if (event->num_free_buffers >= MAX_FREE_SEAT_BUFFERS) {
+    region_free(buffer);
+    return;
+  }
+  buffer->next = event->free_buffers;
+  event->free_buffers = buffer;
+  event->num_free_buffers++;
+}
+
+/// Makes room for the record of the last reservation created in an event,
+/// so that it can be cancelled without scanning the event.
+/// @note The caller must hold the event mutex.
+/// @return The buffer to store the indexes of the num_seats seats of the
+/// reservation in, NULL on failure.
+static struct SeatBuffer *record_reservation(struct Event *event,
+                                             size_t num_seats) {
+  size_t id = event->reservations;
+  if (id > event->records_capacity) {
+    size_t capacity = event->records_capacity ? event->records_capacity * 2 : 8;
+    struct ReservationRecord *records =
+        region_realloc(event->records,
+                       capacity * sizeof(struct ReservationRecord));
+    if (records == NULL) {
+      return NULL;
+    }
+    event->records = records;
+    event->records_capacity = capacity;
   }
-  pthread_mutex_lock(&event->mutex);
 
+  struct SeatBuffer *buffer = take_seat_buffer(event, num_seats);
+  if (buffer == NULL) {
+    return NULL;
+  }
+  event->records[id - 1] = (struct ReservationRecord){num_seats, buffer};
+  return buffer;
+}
+
+/// Reserves seats in an event, undoing the seats already taken if any of
+/// them cannot be reserved.
+/// @note The caller must hold the event mutex.
+/// @return 0 if the reservation was created successfully, 1 otherwise.
+static int reserve_seats(struct Event *event, size_t num_seats,
+                         const size_t *xs, const size_t *ys) {
   unsigned int reservation_id = ++event->reservations;
 
   size_t i = 0;
@@ -164,46 +453,478 @@ int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs,
       break;
     }
 
+    mark_dirty(event, seat_index(event, row, col));
     *get_seat_with_delay(event, seat_index(event, row, col)) = reservation_id;
   }
 
+  int recorded = 0;
+  if (i == num_seats) {
+    struct SeatBuffer *buffer = record_reservation(event, num_seats);
+    recorded = buffer != NULL;
+    if (!recorded) {
+      fprintf(stderr, "Error allocating memory for reservation\n");
+    }
+    for (size_t j = 0; recorded && j < num_seats; j++) {
+      buffer->seats[j] = seat_index(event, xs[j], ys[j]);
+    }
+  }
+
   // If the reservation was not successful, free the seats that were reserved.
-  if (i < num_seats) {
+  if (!recorded) {
     event->reservations--;
     for (size_t j = 0; j < i; j++) {
+      mark_dirty(event, seat_index(event, xs[j], ys[j]));
       *get_seat_with_delay(event, seat_index(event, xs[j], ys[j])) = 0;
     }
-    pthread_mutex_unlock(&event->mutex);
-    pthread_mutex_unlock(&event_list->mutex);
     return 1;
   }
-  pthread_mutex_unlock(&event->mutex);
-  pthread_mutex_unlock(&event_list->mutex);
   return 0;
 }
 
-int ems_show(unsigned int event_id, int fd_out) {
-  if (event_list == NULL) {
-    fprintf(stderr, "EMS state must be initialized\n");
+/// Frees the seats of the last reservation created in an event.
+/// @note The caller must hold the event mutex.
+static void release_seats(struct Event *event, size_t num_seats,
+                          const size_t *xs, const size_t *ys) {
+  for (size_t i = 0; i < num_seats; i++) {
+    mark_dirty(event, seat_index(event, xs[i], ys[i]));
+    *get_seat_with_delay(event, seat_index(event, xs[i], ys[i])) = 0;
+  }
+  give_seat_buffer(event, event->records[event->reservations - 1].buffer);
+  event->reservations--;
+}
+
+int ems_reserve(unsigned int event_id, size_t num_seats, const size_t *xs,
+                const size_t *ys) {
+  if (check_state() != 0) {
     return 1;
   }
 
-  pthread_mutex_lock(&event_list->mutex);
-  struct Event *event = get_event_with_delay(event_id);
+  epoch_enter();
 
+  struct Event *event = lock_event(event_id);
   if (event == NULL) {
     fprintf(stderr, "Event not found\n");
-    pthread_mutex_unlock(&event_list->mutex);
+    epoch_exit();
     return 1;
   }
 
-  pthread_mutex_lock(&event->mutex);
+  int result = reserve_seats(event, num_seats, xs, ys);
+
+  unlock_event(event);
+  epoch_exit();
+  return result;
+}
 
+/// Tells whether every seat of a row span is free.
+static int span_is_free(const unsigned int *span, size_t len) {
+  // No early exit, so that the compiler can vectorize the scan.
+  unsigned int taken = 0;
+  for (size_t i = 0; i < len; i++) {
+    taken |= span[i];
+  }
+  return taken == 0;
+}
+
+/// Assigns every seat of a row span to a reservation.
+static void fill_span(unsigned int *span, size_t len,
+                      unsigned int reservation_id) {
+  for (size_t i = 0; i < len; i++) {
+    span[i] = reservation_id;
+  }
+}
+
+/// Frees the seats of a row span assigned to a reservation.
+static void clear_span(unsigned int *span, size_t len,
+                       unsigned int reservation_id) {
+  for (size_t i = 0; i < len; i++) {
+    span[i] = span[i] == reservation_id ? 0 : span[i];
+  }
+}
+
+/// Reserves blocks of seats in an event one row span at a time, undoing the
+/// spans already taken if any of them cannot be reserved.
+/// @note The caller must hold the event mutex.
+/// @return 0 if the reservation was created successfully, 1 otherwise.
+static int reserve_ranges(struct Event *event, size_t num_ranges,
+                          const struct SeatRange *ranges) {
+  size_t num_seats = 0;
+  for (size_t i = 0; i < num_ranges; i++) {
+    const struct SeatRange *range = &ranges[i];
+    if (range->first_row <= 0 || range->first_row > range->last_row ||
+        range->last_row > event->rows || range->first_col <= 0 ||
+        range->first_col > range->last_col || range->last_col > event->cols) {
+      fprintf(stderr, "Invalid seat\n");
+      return 1;
+    }
+    num_seats += (range->last_row - range->first_row + 1) *
+                 (range->last_col - range->first_col + 1);
+  }
+
+  unsigned int reservation_id = ++event->reservations;
+
+  // Position of the span that could not be taken, if any.
+  size_t failed_range = num_ranges;
+  size_t failed_row = 0;
+  for (size_t i = 0; i < num_ranges && failed_range == num_ranges; i++) {
+    const struct SeatRange *range = &ranges[i];
+    size_t len = range->last_col - range->first_col + 1;
+    for (size_t row = range->first_row; row <= range->last_row; row++) {
+      size_t index = seat_index(event, row, range->first_col);
+      unsigned int *span = get_seat_with_delay(event, index);
+      if (!span_is_free(span, len)) {
+        fprintf(stderr, "Seat already reserved\n");
+        failed_range = i;
+        failed_row = row;
+        break;
+      }
+      mark_dirty(event, index);
+      fill_span(span, len, reservation_id);
+    }
+  }
+
+  struct SeatBuffer *buffer = NULL;
+  if (failed_range == num_ranges) {
+    buffer = record_reservation(event, num_seats);
+    if (buffer == NULL) {
+      fprintf(stderr, "Error allocating memory for reservation\n");
+    }
+  }
+
+  if (buffer == NULL) {
+    // Blocks may overlap, so only the seats still holding the reservation
+    // are freed, up to the span that failed.
+    event->reservations--;
+    for (size_t i = 0; i < num_ranges && i <= failed_range; i++) {
+      const struct SeatRange *range = &ranges[i];
+      size_t len = range->last_col - range->first_col + 1;
+      for (size_t row = range->first_row; row <= range->last_row; row++) {
+        if (i == failed_range && row == failed_row) {
+          break;
+        }
+        size_t index = seat_index(event, row, range->first_col);
+        mark_dirty(event, index);
+        clear_span(get_seat_with_delay(event, index), len, reservation_id);
+      }
+    }
+    return 1;
+  }
+
+  size_t seat = 0;
+  for (size_t i = 0; i < num_ranges; i++) {
+    const struct SeatRange *range = &ranges[i];
+    for (size_t row = range->first_row; row <= range->last_row; row++) {
+      for (size_t col = range->first_col; col <= range->last_col; col++) {
+        buffer->seats[seat++] = seat_index(event, row, col);
+      }
+    }
+  }
+  return 0;
+}
+
+int ems_reserve_ranges(unsigned int event_id, size_t num_ranges,
+                       const struct SeatRange *ranges) {
+  if (check_state() != 0) {
+    return 1;
+  }
+
+  epoch_enter();
+
+  struct Event *event = lock_event(event_id);
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    epoch_exit();
+    return 1;
+  }
+
+  int result = reserve_ranges(event, num_ranges, ranges);
+
+  unlock_event(event);
+  epoch_exit();
+  return result;
+}
+
+/// Position of a reservation in a batch, sorted by event.
+struct BatchEntry {
+  unsigned int event_id;
+  size_t index;
+};
+
+static int compare_batch_entries(const void *a, const void *b) {
+  const struct BatchEntry *x = a, *y = b;
+  if (x->event_id != y->event_id) {
+    return x->event_id < y->event_id ? -1 : 1;
+  }
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/// Sorts the reservations by event and looks every distinct event up once.
+/// @note The caller must be inside an epoch critical section.
+/// @param order Array to store the reservations sorted by event in.
+/// @param events Array to store the event of every entry of order in, NULL
+/// if it was not found.
+static void lookup_events(size_t num_reservations,
+                          const struct Reservation *reservations,
+                          struct BatchEntry *order, struct Event **events) {
+  for (size_t i = 0; i < num_reservations; i++) {
+    order[i] = (struct BatchEntry){reservations[i].event_id, i};
+  }
+  qsort(order, num_reservations, sizeof(struct BatchEntry),
+        compare_batch_entries);
+
+  for (size_t i = 0; i < num_reservations; i++) {
+    if (i > 0 && order[i].event_id == order[i - 1].event_id) {
+      events[i] = events[i - 1];
+    } else {
+      events[i] = get_event_with_delay(order[i].event_id);
+    }
+  }
+}
+
+size_t ems_reserve_batch(size_t num_reservations,
+                         const struct Reservation *reservations,
+                         int *results) {
+  for (size_t i = 0; i < num_reservations; i++) {
+    results[i] = 1;
+  }
+
+  if (check_state() != 0) {
+    return num_reservations;
+  }
+  if (num_reservations == 0) {
+    return 0;
+  }
+
+  struct BatchEntry *order =
+      malloc(num_reservations * sizeof(struct BatchEntry));
+  struct Event **events = malloc(num_reservations * sizeof(struct Event *));
+  if (order == NULL || events == NULL) {
+    fprintf(stderr, "Error allocating memory for batch\n");
+    free(order);
+    free(events);
+    return num_reservations;
+  }
+
+  // The events stay allocated until the epoch is left, even if deleted.
+  epoch_enter();
+  lookup_events(num_reservations, reservations, order, events);
+
+  size_t failed = 0;
+  size_t end;
+  for (size_t start = 0; start < num_reservations; start = end) {
+    struct Event *event = events[start];
+    end = start + 1;
+    while (end < num_reservations && events[end] == event &&
+           order[end].event_id == order[start].event_id) {
+      end++;
+    }
+
+    if (event != NULL) {
+      ems_mutex_lock(&event->mutex);
+      if (event->deleted) {
+        ems_mutex_unlock(&event->mutex);
+        event = NULL;
+      }
+    }
+    if (event == NULL) {
+      for (size_t i = start; i < end; i++) {
+        fprintf(stderr, "Event not found\n");
+      }
+      failed += end - start;
+      continue;
+    }
+
+    for (size_t i = start; i < end; i++) {
+      const struct Reservation *reservation = &reservations[order[i].index];
+      results[order[i].index] =
+          reserve_seats(event, reservation->num_seats, reservation->xs,
+                        reservation->ys);
+      failed += (size_t)results[order[i].index];
+    }
+    unlock_event(event);
+  }
+  epoch_exit();
+
+  free(order);
+  free(events);
+  return failed;
+}
+
+int ems_reserve_txn(size_t num_reservations,
+                    const struct Reservation *reservations) {
+  if (check_state() != 0) {
+    return 1;
+  }
+  if (num_reservations == 0) {
+    return 0;
+  }
+
+  struct BatchEntry *order =
+      malloc(num_reservations * sizeof(struct BatchEntry));
+  struct Event **events = malloc(num_reservations * sizeof(struct Event *));
+  struct Event **applied = malloc(num_reservations * sizeof(struct Event *));
+  if (order == NULL || events == NULL || applied == NULL) {
+    fprintf(stderr, "Error allocating memory for transaction\n");
+    free(order);
+    free(events);
+    free(applied);
+    return 1;
+  }
+
+  epoch_enter();
+  lookup_events(num_reservations, reservations, order, events);
+  for (size_t i = 0; i < num_reservations; i++) {
+    if (events[i] == NULL) {
+      fprintf(stderr, "Event not found\n");
+      epoch_exit();
+      free(order);
+      free(events);
+      free(applied);
+      return 1;
+    }
+  }
+
+  // Lock every event once, in increasing id order, so that transactions
+  // never wait on each other in a cycle.
+  int result = 0;
+  for (size_t i = 0; i < num_reservations; i++) {
+    if (i == 0 || events[i] != events[i - 1]) {
+      ems_mutex_lock(&events[i]->mutex);
+      if (events[i]->deleted && result == 0) {
+        fprintf(stderr, "Event not found\n");
+        result = 1;
+      }
+    }
+    applied[order[i].index] = events[i];
+  }
+
+  // Apply the reservations in the given order, undoing the ones already
+  // created, newest first, as soon as one fails.
+  for (size_t i = 0; i < num_reservations && result == 0; i++) {
+    const struct Reservation *reservation = &reservations[i];
+    if (reserve_seats(applied[i], reservation->num_seats, reservation->xs,
+                      reservation->ys) != 0) {
+      for (size_t j = i; j > 0; j--) {
+        release_seats(applied[j - 1], reservations[j - 1].num_seats,
+                      reservations[j - 1].xs, reservations[j - 1].ys);
+      }
+      result = 1;
+    }
+  }
+
+  for (size_t i = num_reservations; i > 0; i--) {
+    if (i == 1 || events[i - 1] != events[i - 2]) {
+      unlock_event(events[i - 1]);
+    }
+  }
+  epoch_exit();
+
+  free(order);
+  free(events);
+  free(applied);
+  return result;
+}
+
+int ems_undo_txn(size_t num_reservations,
+                 const struct Reservation *reservations) {
+  if (check_state() != 0) {
+    return 1;
+  }
+
+  epoch_enter();
+  int result = 0;
+  for (size_t i = num_reservations; i > 0 && result == 0; i--) {
+    const struct Reservation *reservation = &reservations[i - 1];
+    struct Event *event = lock_event(reservation->event_id);
+    if (event == NULL) {
+      fprintf(stderr, "Event not found\n");
+      result = 1;
+      break;
+    }
+    release_seats(event, reservation->num_seats, reservation->xs,
+                  reservation->ys);
+    unlock_event(event);
+  }
+  epoch_exit();
+  return result;
+}
+
+int ems_cancel(unsigned int event_id, unsigned int reservation_id) {
+  if (check_state() != 0) {
+    return 1;
+  }
+
+  epoch_enter();
+
+  struct Event *event = lock_event(event_id);
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    epoch_exit();
+    return 1;
+  }
+
+  struct ReservationRecord *record =
+      reservation_id > 0 && reservation_id <= event->reservations
+          ? &event->records[reservation_id - 1]
+          : NULL;
+  if (record == NULL || record->buffer == NULL) {
+    fprintf(stderr, "Reservation not found\n");
+    ems_mutex_unlock(&event->mutex);
+    epoch_exit();
+    return 1;
+  }
+
+  for (size_t i = 0; i < record->num_seats; i++) {
+    mark_dirty(event, record->buffer->seats[i]);
+    *get_seat_with_delay(event, record->buffer->seats[i]) = 0;
+  }
+  give_seat_buffer(event, record->buffer);
+  record->buffer = NULL;
+
+  unlock_event(event);
+  epoch_exit();
+  return 0;
+}
+
+int ems_delete(unsigned int event_id) {
+  if (check_state() != 0) {
+    return 1;
+  }
+
+  ems_mutex_lock(&event_list->mutex);
+
+  struct Event *event = get_event_with_delay(event_id);
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    ems_mutex_unlock(&event_list->mutex);
+    return 1;
+  }
+
+  // Wait for the operations already on the event, and make the ones that
+  // looked it up but have not locked it yet fail.
+  ems_mutex_lock(&event->mutex);
+  event->deleted = 1;
+  ems_mutex_unlock(&event->mutex);
+
+  int result = remove_from_list(event_list, event);
+  ems_mutex_unlock(&event_list->mutex);
+  return result;
+}
+
+/// Writes the seats of an event, row by row.
+/// @param version Version to read the seats from, NULL to read them from the
+/// event itself, in which case the caller must hold the event mutex.
+static void write_seats(struct Event *event, const struct SeatVersion *version,
+                        int fd_out) {
   for (size_t i = 1; i <= event->rows; i++) {
     for (size_t j = 1; j <= event->cols; j++) {
-      unsigned int *seat = get_seat_with_delay(event, seat_index(event, i, j));
+      unsigned int seat;
+      if (version != NULL) {
+        seat = get_published_seat_with_delay(version, i, j);
+      } else {
+        seat = *get_seat_with_delay(event, seat_index(event, i, j));
+      }
       char seatchar[64];
-      sprintf(seatchar, "%u", *seat);
+      sprintf(seatchar, "%u", seat);
       mywrite(fd_out, seatchar);
 
       if (j < event->cols) {
@@ -212,36 +933,122 @@ int ems_show(unsigned int event_id, int fd_out) {
     }
     mywrite(fd_out, "\n");
   }
-  pthread_mutex_unlock(&event->mutex);
-  pthread_mutex_unlock(&event_list->mutex);
-  return 0;
 }
 
-int ems_list_events(int fd_out) {
-  if (event_list == NULL) {
-    fprintf(stderr, "EMS state must be initialized\n");
+int ems_show(unsigned int event_id, int fd_out) {
+  if (check_state() != 0) {
     return 1;
   }
-  pthread_mutex_lock(&event_list->mutex);
-  if (event_list->head == NULL) {
-    mywrite(fd_out, "No events\n");
-    pthread_mutex_unlock(&event_list->mutex);
-    return 0;
+
+  // The version is read without locking the event, so reservations go on
+  // while it is written out.
+  epoch_enter();
+  struct Event *event = get_event_with_delay(event_id);
+
+  if (event == NULL || event->deleted) {
+    fprintf(stderr, "Event not found\n");
+    epoch_exit();
+    return 1;
   }
 
-  struct ListNode *current = event_list->head;
+  if (atomic_load_explicit(&event->stale, memory_order_acquire)) {
+    // The last write could not publish its seats, so they are read under the
+    // mutex unless they can be published now.
+    ems_mutex_lock(&event->mutex);
+    if (publish_seats(event) != 0) {
+      write_seats(event, NULL, fd_out);
+      ems_mutex_unlock(&event->mutex);
+      epoch_exit();
+      return 0;
+    }
+    atomic_store_explicit(&event->stale, 0, memory_order_release);
+    ems_mutex_unlock(&event->mutex);
+  }
+
+  write_seats(event,
+              atomic_load_explicit(&event->version, memory_order_acquire),
+              fd_out);
+  epoch_exit();
+  return 0;
+}
+
+/// Collects the ids of the events that are not deleted, in list order.
+/// @note The caller must hold the list mutex or be inside an epoch critical
+/// section.
+/// @param ids Array to store the ids in, grown as needed.
+/// @param capacity Number of ids the array can hold.
+/// @return The number of ids collected, or SIZE_MAX on failure.
+static size_t collect_event_ids(unsigned int **ids, size_t *capacity) {
+  size_t listed = 0;
+  struct ListNode *current =
+      atomic_load_explicit(&event_list->head, memory_order_acquire);
   while (current != NULL) {
-    pthread_mutex_lock(&(current->event)->mutex);
-    mywrite(fd_out, "Event: ");
-    char id[64];
-    sprintf(id, "%u", (current->event)->id);
-    mywrite(fd_out, strcat(id, "\n"));
-    pthread_mutex_unlock(&(current->event)->mutex);
+    if (!current->event->deleted) {
+      if (listed == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 16;
+        unsigned int *resized = realloc(*ids, grown * sizeof(unsigned int));
+        if (resized == NULL) {
+          return SIZE_MAX;
+        }
+        *ids = resized;
+        *capacity = grown;
+      }
+      (*ids)[listed++] = current->event->id;
+    }
+    current = atomic_load_explicit(&current->next, memory_order_acquire);
+  }
+  return listed;
+}
 
-    current = current->next;
+int ems_list_events(int fd_out) {
+  if (check_state() != 0) {
+    return 1;
   }
+  epoch_enter();
 
-  pthread_mutex_unlock(&event_list->mutex);
+  // The list is walked without locks and walked again if an event was
+  // created or deleted meanwhile. After LIST_MAX_RETRIES walks, the list
+  // mutex is taken, which holds back CREATE and DELETE but no reservation.
+  unsigned int *ids = NULL;
+  size_t capacity = 0;
+  size_t listed = SIZE_MAX;
+  for (int attempt = 0; attempt <= LIST_MAX_RETRIES; attempt++) {
+    if (attempt == LIST_MAX_RETRIES) {
+      ems_mutex_lock(&event_list->mutex);
+      listed = collect_event_ids(&ids, &capacity);
+      ems_mutex_unlock(&event_list->mutex);
+      break;
+    }
+
+    unsigned long changes =
+        atomic_load_explicit(&event_list->changes, memory_order_acquire);
+    if (changes % 2 != 0) {
+      continue;
+    }
+    listed = collect_event_ids(&ids, &capacity);
+    atomic_thread_fence(memory_order_acquire);
+    if (listed == SIZE_MAX ||
+        atomic_load_explicit(&event_list->changes, memory_order_relaxed) ==
+            changes) {
+      break;
+    }
+  }
+  epoch_exit();
+
+  if (listed == SIZE_MAX) {
+    fprintf(stderr, "Error allocating memory for event list\n");
+    free(ids);
+    return 1;
+  }
+  for (size_t i = 0; i < listed; i++) {
+    char line[64];
+    sprintf(line, "Event: %u\n", ids[i]);
+    mywrite(fd_out, line);
+  }
+  if (listed == 0) {
+    mywrite(fd_out, "No events\n");
+  }
+  free(ids);
   return 0;
 }
 
@@ -4,11 +4,13 @@
 #include <stddef.h>
 
 /// Initializes the EMS state.
+/// @note In a process forked after the state was initialized in a shared
+/// region, attaches to that state instead.
 /// @param delay_ms State access delay in milliseconds.
 /// @return 0 if the EMS state was initialized successfully, 1 otherwise.
 int ems_init(unsigned int delay_ms);
 
-/// Destroys the EMS state.
+/// Destroys the EMS state, or detaches from it if it is shared.
 int ems_terminate();
 
 /// Creates a new event with the given id and dimensions.
@@ -24,8 +26,67 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 /// @param xs Array of rows of the seats to reserve.
 /// @param ys Array of columns of the seats to reserve.
 /// @return 0 if the reservation was created successfully, 1 otherwise.
-int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs,
-                size_t *ys);
+int ems_reserve(unsigned int event_id, size_t num_seats, const size_t *xs,
+                const size_t *ys);
+
+struct SeatRange;
+
+/// Creates a new reservation of blocks of seats for the given event. Every
+/// row of a block is checked and taken at once, as a single state access.
+/// @param event_id Id of the event to create a reservation for.
+/// @param num_ranges Number of blocks to reserve.
+/// @param ranges Array of blocks to reserve, which may be single seats.
+/// @return 0 if the reservation was created successfully, 1 otherwise.
+int ems_reserve_ranges(unsigned int event_id, size_t num_ranges,
+                       const struct SeatRange *ranges);
+
+/// A reservation of seats in one event, as grouped by a batch.
+struct Reservation {
+  unsigned int event_id; /// Id of the event to create the reservation for.
+  size_t num_seats;      /// Number of seats to reserve.
+  const size_t *xs;      /// Rows of the seats to reserve.
+  const size_t *ys;      /// Columns of the seats to reserve.
+};
+
+/// Creates several independent reservations. The reservations are grouped by
+/// event so that every event is looked up and locked only once; the
+/// reservations of each event are created in the given order.
+/// @param num_reservations Number of reservations.
+/// @param reservations Reservations to create.
+/// @param results Array to store the result of every reservation in: 0 if
+/// it was created successfully, 1 otherwise.
+/// @return Number of reservations that failed.
+size_t ems_reserve_batch(size_t num_reservations,
+                         const struct Reservation *reservations, int *results);
+
+/// Creates several reservations atomically: either all of them are created
+/// or none is. The events are locked in increasing id order, so concurrent
+/// transactions cannot deadlock.
+/// @param num_reservations Number of reservations.
+/// @param reservations Reservations to create, applied in the given order.
+/// @return 0 if every reservation was created successfully, 1 otherwise.
+int ems_reserve_txn(size_t num_reservations,
+                    const struct Reservation *reservations);
+
+/// Undoes a transaction created by ems_reserve_txn, newest reservation first.
+/// @note No other reservation may have been created in its events since.
+/// @param num_reservations Number of reservations.
+/// @param reservations Reservations of the transaction, in the given order.
+/// @return 0 if the transaction was undone successfully, 1 otherwise.
+int ems_undo_txn(size_t num_reservations,
+                 const struct Reservation *reservations);
+
+/// Cancels a reservation, freeing its seats.
+/// @param event_id Id of the event of the reservation.
+/// @param reservation_id Id of the reservation to cancel.
+/// @return 0 if the reservation was cancelled successfully, 1 otherwise.
+int ems_cancel(unsigned int event_id, unsigned int reservation_id);
+
+/// Deletes an event. Operations already running on it finish first, and its
+/// memory is reclaimed once no thread can still be reading it.
+/// @param event_id Id of the event to delete.
+/// @return 0 if the event was deleted successfully, 1 otherwise.
+int ems_delete(unsigned int event_id);
 
 /// Prints the given event.
 /// @param event_id Id of the event to print.
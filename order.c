@@ -0,0 +1,226 @@
+#include "order.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+/// Slots of a history when it first records an event.
+#define HISTORY_MIN_CAPACITY 64
+
+struct LineOrder {
+  pthread_mutex_t mutex;
+  pthread_cond_t done; /// Broadcast when a line is done and a thread waits.
+  /// Threads waiting for a line. Lets order_done skip the mutex when there
+  /// are none.
+  atomic_int waiters;
+  int num_threads;
+  int capacity;
+  atomic_int *completed; /// Last line done by each thread.
+};
+
+struct LineOrder *order_create(int capacity) {
+  struct LineOrder *order = malloc(sizeof(struct LineOrder));
+  if (order == NULL) {
+    fprintf(stderr, "Error allocating memory for line order\n");
+    return NULL;
+  }
+  order->completed = malloc((size_t)capacity * sizeof(atomic_int));
+  if (order->completed == NULL) {
+    fprintf(stderr, "Error allocating memory for line order\n");
+    free(order);
+    return NULL;
+  }
+
+  pthread_mutex_init(&order->mutex, NULL);
+  pthread_cond_init(&order->done, NULL);
+  atomic_init(&order->waiters, 0);
+  order->num_threads = capacity;
+  order->capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    atomic_init(&order->completed[i], 0);
+  }
+  return order;
+}
+
+void order_destroy(struct LineOrder *order) {
+  pthread_cond_destroy(&order->done);
+  pthread_mutex_destroy(&order->mutex);
+  free(order->completed);
+  free(order);
+}
+
+void order_reset(struct LineOrder *order, int num_threads) {
+  order->num_threads = num_threads;
+  for (int i = 0; i < order->capacity; i++) {
+    atomic_store(&order->completed[i], 0);
+  }
+}
+
+/// Waits until a line is done.
+/// @param line Line to wait for, nothing is waited for if 0.
+static void wait_line(struct LineOrder *order, int line) {
+  if (line <= 0) {
+    return;
+  }
+  atomic_int *completed = &order->completed[line % order->num_threads];
+  if (atomic_load(completed) >= line) {
+    return;
+  }
+
+  TRACE_START(trace_start);
+  pthread_mutex_lock(&order->mutex);
+  // Counted before checking again, so that order_done either sees a waiter
+  // or stores the line before it is checked.
+  atomic_fetch_add(&order->waiters, 1);
+  while (atomic_load(completed) < line) {
+    pthread_cond_wait(&order->done, &order->mutex);
+  }
+  atomic_fetch_sub(&order->waiters, 1);
+  pthread_mutex_unlock(&order->mutex);
+  TRACE_COMPLETE("order wait", trace_start, line);
+}
+
+/// Waits until every line before the given one is done.
+static void wait_all(struct LineOrder *order, int line) {
+  int num_threads = order->num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    // The last line before this one owned by thread i.
+    int offset = ((line - 1 - i) % num_threads + num_threads) % num_threads;
+    wait_line(order, line - 1 - offset);
+  }
+}
+
+static int *history_slot(struct LineHistory *history, unsigned int event_id);
+
+/// Doubles the table of a history.
+/// @return 0 on success, 1 on failure.
+static int grow_history(struct LineHistory *history) {
+  size_t capacity =
+      history->capacity ? history->capacity * 2 : HISTORY_MIN_CAPACITY;
+  unsigned int *event_ids = malloc(capacity * sizeof(unsigned int));
+  int *lines = calloc(capacity, sizeof(int));
+  if (event_ids == NULL || lines == NULL) {
+    fprintf(stderr, "Error allocating memory for line history\n");
+    free(event_ids);
+    free(lines);
+    return 1;
+  }
+
+  struct LineHistory old = *history;
+  history->event_ids = event_ids;
+  history->lines = lines;
+  history->capacity = capacity;
+  history->count = 0;
+  for (size_t i = 0; i < old.capacity; i++) {
+    if (old.lines[i] != 0) {
+      *history_slot(history, old.event_ids[i]) = old.lines[i];
+    }
+  }
+  free(old.event_ids);
+  free(old.lines);
+  return 0;
+}
+
+/// Gets the last line that touched an event, adding the event if needed.
+/// @return Pointer to the line, 0 if none, to be set to the line touching it
+/// now. NULL if the event could not be added.
+static int *history_slot(struct LineHistory *history, unsigned int event_id) {
+  // At most half full, so that probes stay short.
+  if (2 * (history->count + 1) > history->capacity &&
+      grow_history(history) != 0) {
+    return NULL;
+  }
+
+  size_t mask = history->capacity - 1;
+  size_t i = (size_t)(event_id * 2654435761u) & mask;
+  while (history->lines[i] != 0 && history->event_ids[i] != event_id) {
+    i = (i + 1) & mask;
+  }
+  if (history->lines[i] == 0) {
+    history->event_ids[i] = event_id;
+    history->count++;
+  }
+  return &history->lines[i];
+}
+
+/// Waits for the last line that touched an event if the line is owned, then
+/// records the line as the last.
+static void touch_event(struct LineOrder *order, struct LineHistory *history,
+                        unsigned int event_id, int line, int owned) {
+  int *last = history_slot(history, event_id);
+  if (last == NULL) {
+    history->lost = 1;
+    return;
+  }
+  // A batch may touch an event more than once.
+  if (owned && !history->lost && *last < line) {
+    wait_line(order, *last);
+  }
+  *last = line;
+}
+
+/// Waits for the last line that touched the list of events if the line is
+/// owned, then records the line as the last.
+static void touch_catalog(struct LineOrder *order, struct LineHistory *history,
+                          int line, int owned) {
+  if (owned && !history->lost) {
+    wait_line(order, history->catalog_line);
+  }
+  history->catalog_line = line;
+}
+
+void order_wait(struct LineOrder *order, struct LineHistory *history,
+                const struct Request *req, int line, int owned) {
+  switch (req->cmd) {
+  case CMD_CREATE:
+  case CMD_DELETE:
+    touch_event(order, history, req->event_id, line, owned);
+    touch_catalog(order, history, line, owned);
+    break;
+  case CMD_LIST_EVENTS:
+    touch_catalog(order, history, line, owned);
+    break;
+  case CMD_RESERVE:
+  case CMD_CANCEL:
+  case CMD_SHOW:
+    touch_event(order, history, req->event_id, line, owned);
+    break;
+  case CMD_BATCH:
+  case CMD_TXN:
+    for (size_t i = 0; i < req->batch->num_reservations; i++) {
+      touch_event(order, history, req->batch->reservations[i].event_id, line,
+                  owned);
+    }
+    break;
+  case CMD_WAIT:
+  case CMD_BARRIER:
+  case CMD_END:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+
+  if (owned && history->lost) {
+    wait_all(order, line);
+  }
+}
+
+void order_done(struct LineOrder *order, int thread_id, int line) {
+  atomic_store(&order->completed[thread_id], line);
+  if (atomic_load(&order->waiters) > 0) {
+    pthread_mutex_lock(&order->mutex);
+    pthread_cond_broadcast(&order->done);
+    pthread_mutex_unlock(&order->mutex);
+  }
+}
+
+void history_free(struct LineHistory *history) {
+  free(history->event_ids);
+  free(history->lines);
+  *history = (struct LineHistory){0};
+}
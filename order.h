@@ -0,0 +1,58 @@
+#ifndef EMS_ORDER_H
+#define EMS_ORDER_H
+
+#include "aux.h"
+
+/// Runs the commands of a job file that touch the same event in the order of
+/// their lines, whichever thread owns them, so that the output does not
+/// depend on the number of threads.
+///
+/// Every thread parses every line and keeps, in a LineHistory, the last line
+/// that touched each event and the last that touched the list of events.
+/// Before running a line it owns, a thread waits for those lines to be done.
+/// Each of them waited for its own predecessors before running, so every
+/// earlier line on the same events is done too. Threads own their lines round
+/// robin and run them in order, so a line is done once the last line done by
+/// its owner is at least as far.
+struct LineOrder;
+
+/// Lines seen by a thread, see LineOrder.
+/// @note Must be zero-initialized before the first use and released with
+/// history_free.
+struct LineHistory {
+  unsigned int *event_ids; /// Open addressing table of the events seen.
+  int *lines;              /// Last line that touched each event, 0 if none.
+  size_t capacity;         /// Slots of the table, a power of two.
+  size_t count;            /// Events in the table.
+  int catalog_line;        /// Last CREATE, DELETE or LIST.
+  int lost; /// Set if an event could not be recorded, so that every earlier
+            /// line is waited for instead.
+};
+
+/// Creates the order of the threads of a job file.
+/// @param capacity Largest number of threads.
+/// @return The order, NULL on failure.
+struct LineOrder *order_create(int capacity);
+
+/// Destroys an order.
+void order_destroy(struct LineOrder *order);
+
+/// Starts over from line 1, e.g. after a BARRIER.
+/// @note No thread may be running.
+/// @param num_threads Threads that own the lines from now on.
+void order_reset(struct LineOrder *order, int num_threads);
+
+/// Records a line in the history of the calling thread and, if the thread
+/// owns it, waits for the earlier lines touching the same events to be done.
+/// @param req Command of the line.
+/// @param owned Whether the calling thread runs the line.
+void order_wait(struct LineOrder *order, struct LineHistory *history,
+                const struct Request *req, int line, int owned);
+
+/// Marks the lines of a thread up to line as done.
+void order_done(struct LineOrder *order, int thread_id, int line);
+
+/// Releases the memory held by a history.
+void history_free(struct LineHistory *history);
+
+#endif // EMS_ORDER_H
@@ -1,5 +1,6 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,12 +9,34 @@
 
 #include "constants.h"
 
+/// Reads count bytes, retrying on short reads, since a command may arrive in
+/// pieces from a pipe or a socket.
+/// @return The number of bytes read, less than count only at the end of the
+/// input or on error, -1 if nothing could be read.
+static ssize_t read_full(int fd, void *buf, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t n = read(fd, (char *)buf + done, count - done);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done > 0 ? (ssize_t)done : -1;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
 static int read_uint(int fd, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_full(fd, buf + i, 1) == 0) {
       *next = '\0';
       break;
     }
@@ -39,30 +62,61 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
+static const char *command_names[] = {
+    [CMD_CREATE] = "CREATE",   [CMD_RESERVE] = "RESERVE",
+    [CMD_CANCEL] = "CANCEL",   [CMD_DELETE] = "DELETE",
+    [CMD_SHOW] = "SHOW",       [CMD_LIST_EVENTS] = "LIST",
+    [CMD_BARRIER] = "BARRIER", [CMD_BATCH] = "BATCH",
+    [CMD_TXN] = "TXN",         [CMD_END] = "END",
+    [CMD_WAIT] = "WAIT",       [CMD_HELP] = "HELP",
+    [CMD_EMPTY] = "EMPTY",     [CMD_INVALID] = "INVALID",
+    [EOC] = "EOC"};
+
+const char *command_name(enum Command cmd) { return command_names[cmd]; }
+
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_full(fd, &ch, 1) == 1 && ch != '\n')
     ;
 }
 
+void skip_line(int fd) { cleanup(fd); }
+
 enum Command get_next(int fd, int *line) {
   char buf[16];
   (*line)++;
-  if (read(fd, buf, 1) != 1) {
+  if (read_full(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'C':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "CREATE ", 7) != 0) {
+    if (read_full(fd, buf + 1, 6) != 6) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "CREATE ", 7) == 0) {
+      return CMD_CREATE;
+    }
+
+    if (strncmp(buf, "CANCEL ", 7) == 0) {
+      return CMD_CANCEL;
+    }
+
+    cleanup(fd);
+    return CMD_INVALID;
+
+  case 'D':
+    if (read_full(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    return CMD_CREATE;
+    return CMD_DELETE;
 
   case 'R':
-    if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "RESERVE ", 8) != 0) {
+    if (read_full(fd, buf + 1, 7) != 7 || strncmp(buf, "RESERVE ", 8) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -70,7 +124,7 @@ enum Command get_next(int fd, int *line) {
     return CMD_RESERVE;
 
   case 'S':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "SHOW ", 5) != 0) {
+    if (read_full(fd, buf + 1, 4) != 4 || strncmp(buf, "SHOW ", 5) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -78,12 +132,12 @@ enum Command get_next(int fd, int *line) {
     return CMD_SHOW;
 
   case 'L':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
+    if (read_full(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (read_full(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -91,20 +145,60 @@ enum Command get_next(int fd, int *line) {
     return CMD_LIST_EVENTS;
 
   case 'B':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "BARRIER", 7) != 0) {
+    if (read_full(fd, buf + 1, 4) != 4) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
+    if (strncmp(buf, "BATCH", 5) == 0) {
+      if (read_full(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_BATCH;
+    }
+
+    if (read_full(fd, buf + 5, 2) != 2 || strncmp(buf, "BARRIER", 7) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (read_full(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
 
     return CMD_BARRIER;
 
+  case 'T':
+    if (read_full(fd, buf + 1, 2) != 2 || strncmp(buf, "TXN", 3) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (read_full(fd, buf + 3, 1) != 0 && buf[3] != '\n') {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_TXN;
+
+  case 'E':
+    if (read_full(fd, buf + 1, 2) != 2 || strncmp(buf, "END", 3) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (read_full(fd, buf + 3, 1) != 0 && buf[3] != '\n') {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_END;
+
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+    if (read_full(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -112,12 +206,12 @@ enum Command get_next(int fd, int *line) {
     return CMD_WAIT;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+    if (read_full(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (read_full(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -163,8 +257,31 @@ int parse_create(int fd, unsigned int *event_id, size_t *num_rows,
   return 0;
 }
 
-size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs,
-                     size_t *ys) {
+/// Reads a seat coordinate, either a number or a range of numbers "a..b".
+/// @param next Pointer to the variable to store the character after it in.
+/// @return 0 if the coordinate was read successfully, 1 otherwise.
+static int read_span(int fd, size_t *first, size_t *last, char *next) {
+  unsigned int value;
+  if (read_uint(fd, &value, next) != 0) {
+    return 1;
+  }
+  *first = (size_t)value;
+  *last = (size_t)value;
+  if (*next != '.') {
+    return 0;
+  }
+
+  char ch;
+  if (read_full(fd, &ch, 1) != 1 || ch != '.' ||
+      read_uint(fd, &value, next) != 0 || (size_t)value < *first) {
+    return 1;
+  }
+  *last = (size_t)value;
+  return 0;
+}
+
+size_t parse_reserve(int fd, size_t max, unsigned int *event_id,
+                     struct SeatRange *ranges) {
   char ch;
 
   if (read_uint(fd, event_id, &ch) != 0 || ch != ' ') {
@@ -172,35 +289,35 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs,
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (read_full(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  size_t num_coords = 0;
-  while (num_coords < max) {
-    if (read(fd, &ch, 1) != 1 || ch != '(') {
+  size_t num_ranges = 0;
+  while (1) {
+    // Up to max seats and blocks are read, so one more is an error.
+    if (num_ranges == max || read_full(fd, &ch, 1) != 1 || ch != '(') {
       cleanup(fd);
       return 0;
     }
 
-    unsigned int x;
-    if (read_uint(fd, &x, &ch) != 0 || ch != ',') {
+    struct SeatRange *range = &ranges[num_ranges];
+    if (read_span(fd, &range->first_row, &range->last_row, &ch) != 0 ||
+        ch != ',') {
       cleanup(fd);
       return 0;
     }
-    xs[num_coords] = (size_t)x;
 
-    unsigned int y;
-    if (read_uint(fd, &y, &ch) != 0 || ch != ')') {
+    if (read_span(fd, &range->first_col, &range->last_col, &ch) != 0 ||
+        ch != ')') {
       cleanup(fd);
       return 0;
     }
-    ys[num_coords] = (size_t)y;
 
-    num_coords++;
+    num_ranges++;
 
-    if (read(fd, &ch, 1) != 1 || (ch != ' ' && ch != ']')) {
+    if (read_full(fd, &ch, 1) != 1 || (ch != ' ' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -210,17 +327,39 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs,
     }
   }
 
-  if (num_coords == max) {
+  if (read_full(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  return num_ranges;
+}
+
+int parse_cancel(int fd, unsigned int *event_id, unsigned int *reservation_id) {
+  char ch;
+
+  if (read_uint(fd, event_id, &ch) != 0 || ch != ' ') {
     cleanup(fd);
-    return 0;
+    return 1;
+  }
+
+  if (read_uint(fd, reservation_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 1;
   }
 
-  return num_coords;
+  return 0;
+}
+
+int parse_delete(int fd, unsigned int *event_id) {
+  char ch;
+
+  if (read_uint(fd, event_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 1;
+  }
+
+  return 0;
 }
 
 int parse_show(int fd, unsigned int *event_id) {
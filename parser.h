@@ -6,9 +6,14 @@
 enum Command {
   CMD_CREATE,
   CMD_RESERVE,
+  CMD_CANCEL,
+  CMD_DELETE,
   CMD_SHOW,
   CMD_LIST_EVENTS,
   CMD_BARRIER,
+  CMD_BATCH,
+  CMD_TXN,
+  CMD_END,
   CMD_WAIT,
   CMD_HELP,
   CMD_EMPTY,
@@ -16,11 +21,29 @@ enum Command {
   EOC // End of commands
 };
 
+/// Seats of a reservation: every seat from first_row to last_row and from
+/// first_col to last_col, both included. A single seat has first == last.
+struct SeatRange {
+  size_t first_row;
+  size_t last_row;
+  size_t first_col;
+  size_t last_col;
+};
+
+/// Gets the name of a command, as written in the job files.
+/// @param cmd Command to get the name of.
+/// @return Name of the command.
+const char *command_name(enum Command cmd);
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
 enum Command get_next(int fd, int *line);
 
+/// Skips the rest of the current line.
+/// @param fd File descriptor to read from.
+void skip_line(int fd);
+
 /// Parses a CREATE command.
 /// @param fd File descriptor to read from.
 /// @param event_id Pointer to the variable to store the event ID in.
@@ -30,15 +53,30 @@ enum Command get_next(int fd, int *line);
 int parse_create(int fd, unsigned int *event_id, size_t *num_rows,
                  size_t *num_cols);
 
-/// Parses a RESERVE command.
+/// Parses a RESERVE command. Every seat is either a single seat (x,y) or a
+/// block of rows and columns (x1..x2,y1..y2), where either side may also be a
+/// single number.
 /// @param fd File descriptor to read from.
-/// @param max Maximum number of coordinates to read.
+/// @param max Maximum number of seats or blocks to read.
 /// @param event_id Pointer to the variable to store the event ID in.
-/// @param xs Pointer to the array to store the X coordinates in.
-/// @param ys Pointer to the array to store the Y coordinates in.
-/// @return Number of coordinates read. 0 on failure.
-size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs,
-                     size_t *ys);
+/// @param ranges Pointer to the array to store the seats and blocks in.
+/// @return Number of seats and blocks read. 0 on failure.
+size_t parse_reserve(int fd, size_t max, unsigned int *event_id,
+                     struct SeatRange *ranges);
+
+/// Parses a CANCEL command.
+/// @param fd File descriptor to read from.
+/// @param event_id Pointer to the variable to store the event ID in.
+/// @param reservation_id Pointer to the variable to store the reservation ID
+/// in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_cancel(int fd, unsigned int *event_id, unsigned int *reservation_id);
+
+/// Parses a DELETE command.
+/// @param fd File descriptor to read from.
+/// @param event_id Pointer to the variable to store the event ID in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_delete(int fd, unsigned int *event_id);
 
 /// Parses a SHOW command.
 /// @param fd File descriptor to read from.
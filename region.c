@@ -0,0 +1,214 @@
+#include "region.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Blocks are handed out in power of two sizes, from 2^REGION_MIN_SHIFT
+/// bytes up, and are kept in a free list per size once freed.
+#define REGION_MIN_SHIFT 5
+#define REGION_NUM_CLASSES 48
+
+/// Header of every block. The payload follows it, 16-byte aligned.
+struct Block {
+  size_t size_class;  /// Block size is 2^(size_class + REGION_MIN_SHIFT).
+  struct Block *next; /// Next free block of the same size, while free.
+};
+
+/// Start of the shared region.
+struct RegionHeader {
+  size_t size;           /// Size of the mapping.
+  size_t used;           /// Bytes handed out past the header so far.
+  pthread_mutex_t mutex; /// Protects the allocator.
+  atomic_int poisoned;   /// Set once a process died holding a lock.
+  struct Block *free_blocks[REGION_NUM_CLASSES];
+  _Alignas(64) char blocks[];
+};
+
+static struct RegionHeader *region = NULL;
+
+int region_create(size_t size) {
+  if (region != NULL) {
+    fprintf(stderr, "Shared region already created\n");
+    return 1;
+  }
+  if (size <= sizeof(struct RegionHeader)) {
+    fprintf(stderr, "Shared region too small\n");
+    return 1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/ems-%d", (int)getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create shared memory %s: %s\n", name,
+            strerror(errno));
+    return 1;
+  }
+  // Only the processes forked from now on use the region, so the name can
+  // go right away and the memory is released with the last mapping.
+  shm_unlink(name);
+
+  if (ftruncate(fd, (off_t)size) != 0) {
+    fprintf(stderr, "Failed to size shared memory: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct RegionHeader *header = (struct RegionHeader *)mem;
+  memset(header, 0, sizeof(struct RegionHeader));
+  header->size = size;
+  region = header;
+  region_mutex_init(&header->mutex);
+  return 0;
+}
+
+void region_destroy(void) {
+  if (region == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&region->mutex);
+  munmap(region, region->size);
+  region = NULL;
+}
+
+int region_shared(void) { return region != NULL; }
+
+int region_poisoned(void) {
+  return region != NULL &&
+         atomic_load_explicit(&region->poisoned, memory_order_acquire);
+}
+
+/// Gets the smallest size class that fits size bytes of payload.
+/// @return The size class, REGION_NUM_CLASSES if none does.
+static size_t size_class_of(size_t size) {
+  size_t needed = size + sizeof(struct Block);
+  size_t size_class = 0;
+  while (size_class < REGION_NUM_CLASSES &&
+         ((size_t)1 << (size_class + REGION_MIN_SHIFT)) < needed) {
+    size_class++;
+  }
+  return size_class;
+}
+
+void *region_alloc(size_t size) {
+  if (region == NULL) {
+    return malloc(size);
+  }
+
+  size_t size_class = size_class_of(size);
+  if (size_class == REGION_NUM_CLASSES || region_poisoned()) {
+    return NULL;
+  }
+  size_t block_size = (size_t)1 << (size_class + REGION_MIN_SHIFT);
+
+  region_mutex_lock(&region->mutex);
+  struct Block *block = region->free_blocks[size_class];
+  if (block != NULL) {
+    region->free_blocks[size_class] = block->next;
+  } else if (block_size <= region->size - sizeof(struct RegionHeader) -
+                               region->used) {
+    block = (struct Block *)(region->blocks + region->used);
+    block->size_class = size_class;
+    region->used += block_size;
+  }
+  pthread_mutex_unlock(&region->mutex);
+
+  if (block == NULL) {
+    fprintf(stderr, "Shared region full\n");
+    return NULL;
+  }
+  return block + 1;
+}
+
+void *region_realloc(void *ptr, size_t size) {
+  if (region == NULL) {
+    return realloc(ptr, size);
+  }
+  if (ptr == NULL) {
+    return region_alloc(size);
+  }
+
+  struct Block *block = (struct Block *)ptr - 1;
+  size_t capacity =
+      ((size_t)1 << (block->size_class + REGION_MIN_SHIFT)) -
+      sizeof(struct Block);
+  if (size <= capacity) {
+    return ptr;
+  }
+
+  void *grown = region_alloc(size);
+  if (grown != NULL) {
+    memcpy(grown, ptr, capacity);
+    region_free(ptr);
+  }
+  return grown;
+}
+
+void region_free(void *ptr) {
+  if (region == NULL) {
+    free(ptr);
+    return;
+  }
+  if (ptr == NULL || region_poisoned()) {
+    // The free lists may be broken, so the block is left alone.
+    return;
+  }
+
+  struct Block *block = (struct Block *)ptr - 1;
+  region_mutex_lock(&region->mutex);
+  block->next = region->free_blocks[block->size_class];
+  region->free_blocks[block->size_class] = block;
+  pthread_mutex_unlock(&region->mutex);
+}
+
+int region_mutex_init(pthread_mutex_t *mutex) {
+  if (region == NULL) {
+    return pthread_mutex_init(mutex, NULL);
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int result = pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return result;
+}
+
+/// Takes over a mutex whose owner died while holding it.
+/// @param result Result of locking the mutex.
+/// @return 0 if the mutex is now held, an error otherwise.
+static int recover_mutex(pthread_mutex_t *mutex, int result) {
+  if (result != EOWNERDEAD) {
+    return result;
+  }
+  // Whatever the dead process was changing may be half done and nothing
+  // checks it, so the whole state is given up. The mutex is only made
+  // consistent again so that the other processes see that instead of
+  // hanging.
+  fprintf(stderr, "A process died holding a lock, the shared state is lost\n");
+  atomic_store_explicit(&region->poisoned, 1, memory_order_release);
+  pthread_mutex_consistent(mutex);
+  return 0;
+}
+
+void region_mutex_lock(pthread_mutex_t *mutex) {
+  recover_mutex(mutex, pthread_mutex_lock(mutex));
+}
+
+int region_mutex_trylock(pthread_mutex_t *mutex) {
+  return recover_mutex(mutex, pthread_mutex_trylock(mutex));
+}
@@ -0,0 +1,61 @@
+#ifndef EMS_REGION_H
+#define EMS_REGION_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/// Memory the EMS state is allocated from.
+///
+/// By default the state lives in the private heap of the process. Once
+/// region_create is called, it is allocated instead from a shared memory
+/// region (shm_open + mmap(MAP_SHARED)) that every process forked afterwards
+/// maps at the same address, so that pointers into the state stay valid in
+/// all of them. The mutexes of the state are then process-shared.
+
+/// Maps a shared region that the EMS state of this process and of every
+/// child forked afterwards is allocated from.
+/// @param size Size of the region in bytes.
+/// @return 0 if the region was created successfully, 1 otherwise.
+int region_create(size_t size);
+
+/// Unmaps the shared region.
+/// @note Nothing may be allocated from the region anymore.
+void region_destroy(void);
+
+/// Tells whether the state is allocated from a shared region.
+int region_shared(void);
+
+/// Tells whether a process died while holding a lock of the shared state.
+/// What it was changing may be half done, so the state must not be used
+/// anymore.
+int region_poisoned(void);
+
+/// Allocates memory for the EMS state.
+/// @note Fails once the region is poisoned.
+/// @return Pointer to the memory, NULL on failure.
+void *region_alloc(size_t size);
+
+/// Resizes memory allocated with region_alloc.
+/// @return Pointer to the memory, NULL on failure (ptr is left untouched).
+void *region_realloc(void *ptr, size_t size);
+
+/// Frees memory allocated with region_alloc.
+void region_free(void *ptr);
+
+/// Initializes a mutex of the EMS state, process-shared if the state is.
+/// A process-shared mutex is also robust, so that a process dying while it
+/// holds it does not block the others forever.
+/// @return 0 if the mutex was initialized successfully, an error otherwise.
+int region_mutex_init(pthread_mutex_t *mutex);
+
+/// Locks a mutex initialized with region_mutex_init. If its owner died while
+/// holding it, the region is poisoned and the caller takes the mutex over,
+/// see region_poisoned.
+void region_mutex_lock(pthread_mutex_t *mutex);
+
+/// Locks a mutex initialized with region_mutex_init if it is free, as
+/// region_mutex_lock.
+/// @return 0 if the mutex was locked, an error otherwise.
+int region_mutex_trylock(pthread_mutex_t *mutex);
+
+#endif // EMS_REGION_H
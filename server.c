@@ -0,0 +1,540 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aux.h"
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+#include "stats.h"
+#include "trace.h"
+
+/// A client connection, the bytes it sent that were not run yet and the
+/// reply it was not sent yet.
+struct Connection {
+  int fd;
+  char *input;
+  size_t len;
+  size_t capacity;
+  char *output;       /// Reply of the last command, NULL once sent.
+  size_t output_len;  /// Length of the reply.
+  size_t output_sent; /// Bytes of the reply sent so far.
+  int closed; /// The client closed its end, or the connection failed.
+  struct Connection *prev;
+  struct Connection *next;
+};
+
+/// Connections ready to be served. Every connection is armed with
+/// EPOLLONESHOT and is only queued again by the worker that served it, so it
+/// is in the queue at most once and the queue never holds more than
+/// SERVER_MAX_CONNECTIONS entries.
+struct ReadyQueue {
+  struct Connection *conns[SERVER_MAX_CONNECTIONS];
+  size_t head;
+  size_t count;
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+};
+
+struct Worker {
+  pthread_t thread;
+  int id;
+  int input_fd; /// Memory-backed file the commands are parsed from.
+};
+
+static struct ReadyQueue queue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                                  .not_empty = PTHREAD_COND_INITIALIZER};
+static int epoll_fd = -1;
+static atomic_int num_connections = 0;
+
+/// Open connections, so that the ones left are closed at shutdown.
+static struct Connection *connections = NULL;
+static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// Tell the listening socket and the stop pipe apart in the epoll events,
+/// which otherwise carry connections.
+static struct Connection listener = {.fd = -1};
+static struct Connection stopper = {.fd = -1};
+
+/// Self-pipe used by the signal handler to stop the event loop.
+static int stop_pipe[2] = {-1, -1};
+
+static void handle_stop(int sig) {
+  (void)sig;
+  char byte = 0;
+  if (write(stop_pipe[1], &byte, 1) < 0) {
+    // Nothing can be done inside a signal handler.
+  }
+}
+
+static void queue_push(struct Connection *conn) {
+  pthread_mutex_lock(&queue.mutex);
+  queue.conns[(queue.head + queue.count) % SERVER_MAX_CONNECTIONS] = conn;
+  queue.count++;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+/// Waits for a ready connection.
+/// @return The connection, NULL if the server is stopping.
+static struct Connection *queue_pop(void) {
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.count == 0 && !queue.stopping) {
+    pthread_cond_wait(&queue.not_empty, &queue.mutex);
+  }
+
+  struct Connection *conn = NULL;
+  if (!queue.stopping) {
+    conn = queue.conns[queue.head];
+    queue.head = (queue.head + 1) % SERVER_MAX_CONNECTIONS;
+    queue.count--;
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return conn;
+}
+
+/// Arms a connection for its next command, or for the rest of its reply if
+/// it has one left to send.
+static int watch(struct Connection *conn, int op) {
+  uint32_t events = conn->output != NULL ? EPOLLOUT : EPOLLIN;
+  struct epoll_event event = {.events = events | EPOLLONESHOT,
+                              .data.ptr = conn};
+  return epoll_ctl(epoll_fd, op, conn->fd, &event);
+}
+
+static void close_connection(struct Connection *conn) {
+  pthread_mutex_lock(&connections_mutex);
+  if (conn->prev == NULL) {
+    connections = conn->next;
+  } else {
+    conn->prev->next = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  pthread_mutex_unlock(&connections_mutex);
+
+  close(conn->fd);
+  free(conn->input);
+  free(conn->output);
+  free(conn);
+  atomic_fetch_sub(&num_connections, 1);
+}
+
+/// Tells whether a line starts a BATCH or a TXN, which runs up to its END.
+/// @param len Length of the line, including its newline.
+static int starts_block(const char *line, size_t len) {
+  return (len == 6 && memcmp(line, "BATCH\n", 6) == 0) ||
+         (len == 4 && memcmp(line, "TXN\n", 4) == 0);
+}
+
+/// Finds the first complete command of a connection: a line, or every line
+/// of a BATCH or a TXN up to its END. Once the client closed its end, what
+/// is left counts as a command, as it would at the end of a job file.
+/// @return Length of the command, 0 if it is not complete yet.
+static size_t command_length(const struct Connection *conn) {
+  if (conn->len == 0) {
+    return 0;
+  }
+  char *newline = memchr(conn->input, '\n', conn->len);
+  if (newline == NULL) {
+    return conn->closed ? conn->len : 0;
+  }
+  size_t pos = (size_t)(newline - conn->input) + 1;
+  if (!starts_block(conn->input, pos)) {
+    return pos;
+  }
+
+  while ((newline = memchr(conn->input + pos, '\n', conn->len - pos)) !=
+         NULL) {
+    size_t start = pos;
+    pos = (size_t)(newline - conn->input) + 1;
+    if (pos - start == 4 && memcmp(conn->input + start, "END\n", 4) == 0) {
+      return pos;
+    }
+  }
+  return conn->closed ? conn->len : 0;
+}
+
+/// Reads what a connection has available, without blocking, until it holds a
+/// complete command.
+/// @return Length of the command, 0 if it is not complete yet.
+static size_t receive_command(struct Connection *conn) {
+  size_t len;
+  while ((len = command_length(conn)) == 0 && !conn->closed) {
+    if (conn->len == conn->capacity) {
+      if (conn->capacity == SERVER_MAX_COMMAND) {
+        return 0;
+      }
+      size_t capacity =
+          conn->capacity == 0 ? SERVER_INPUT_BUFFER : 2 * conn->capacity;
+      if (capacity > SERVER_MAX_COMMAND) {
+        capacity = SERVER_MAX_COMMAND;
+      }
+      char *input = realloc(conn->input, capacity);
+      if (input == NULL) {
+        fprintf(stderr, "Error allocating memory for connection\n");
+        conn->closed = 1;
+        return 0;
+      }
+      conn->input = input;
+      conn->capacity = capacity;
+    }
+
+    ssize_t n = recv(conn->fd, conn->input + conn->len,
+                     conn->capacity - conn->len, MSG_DONTWAIT);
+    if (n > 0) {
+      conn->len += (size_t)n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    } else {
+      conn->closed = 1;
+    }
+  }
+  return len;
+}
+
+/// Sends what the socket takes of the reply of a connection, without
+/// blocking, so that a client that does not read its replies does not hold
+/// the worker.
+/// @return 0 on success, even if part of the reply is left, 1 if the
+/// connection failed.
+static int send_output(struct Connection *conn) {
+  while (conn->output != NULL) {
+    if (conn->output_sent == conn->output_len) {
+      free(conn->output);
+      conn->output = NULL;
+      break;
+    }
+    ssize_t n = send(conn->fd, conn->output + conn->output_sent,
+                     conn->output_len - conn->output_sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n >= 0) {
+      conn->output_sent += (size_t)n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    } else if (errno != EINTR) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Executes the first command of a connection, keeps its reply to be sent,
+/// then drops the command from the input.
+/// @param len Length of the command, as found by command_length.
+/// @param input_fd Memory-backed file of the worker, which the command is
+/// copied to so that the parser reads it as it would a job file.
+static void serve_command(struct Connection *conn, size_t len, int input_fd) {
+  struct Request req = {0};
+  int line = 0;
+
+  STATS_START(start);
+  TRACE_START(trace_start);
+  enum Command cmd = EOC;
+  if (ftruncate(input_fd, (off_t)len) != 0 ||
+      pwrite(input_fd, conn->input, len, 0) != (ssize_t)len ||
+      lseek(input_fd, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Failed to buffer command: %s\n", strerror(errno));
+  } else {
+    cmd = read_request(input_fd, &line, &req);
+  }
+  conn->len -= len;
+  memmove(conn->input, conn->input + len, conn->len);
+  if (cmd == EOC) {
+    free_request(&req);
+    return;
+  }
+  STATS_SET_CONTEXT(cmd, line);
+
+  // The reply is sent by send_output, as the socket takes it.
+  output_capture_begin();
+  int result = 0;
+  if (cmd == CMD_HELP) {
+    mywrite(conn->fd, HELP_TEXT);
+  } else {
+    result = execute_request(&req, conn->fd);
+  }
+
+  // A batch also reports the result of each of its reservations, in order.
+  if (cmd == CMD_BATCH) {
+    mywrite(conn->fd, "BATCH");
+    for (size_t i = 0; i < req.batch->num_reservations; i++) {
+      mywrite(conn->fd, req.batch->results[i] ? " ERR" : " OK");
+    }
+    mywrite(conn->fd, "\n");
+  }
+  mywrite(conn->fd, result ? "ERR\n" : "OK\n");
+  conn->output = output_capture_end(&conn->output_len);
+  conn->output_sent = 0;
+  if (conn->output == NULL) {
+    fprintf(stderr, "Error allocating memory for reply\n");
+    conn->closed = 1;
+  }
+  free_request(&req);
+  STATS_RECORD_COMMAND(cmd, 1, start);
+  TRACE_COMPLETE(command_name(cmd), trace_start, conn->fd);
+}
+
+/// Serves at most one command of a ready connection. A connection with more
+/// complete commands goes back to the end of the queue, so that the others
+/// get their turn; one still waiting for the rest of a command, or for its
+/// client to read the reply, goes back to epoll instead of holding the
+/// worker. No command is read while a reply is left to send.
+static void serve_connection(struct Connection *conn, int input_fd) {
+  if (conn->output == NULL) {
+    size_t len = receive_command(conn);
+    if (len > 0) {
+      serve_command(conn, len, input_fd);
+    }
+  }
+
+  if (send_output(conn) != 0) {
+    close_connection(conn);
+  } else if (conn->output != NULL) {
+    if (watch(conn, EPOLL_CTL_MOD) != 0) {
+      fprintf(stderr, "Failed to watch connection: %s\n", strerror(errno));
+      close_connection(conn);
+    }
+  } else if (command_length(conn) > 0) {
+    queue_push(conn);
+  } else if (conn->closed) {
+    close_connection(conn);
+  } else if (conn->len == SERVER_MAX_COMMAND) {
+    fprintf(stderr, "Command too long\n");
+    close_connection(conn);
+  } else if (watch(conn, EPOLL_CTL_MOD) != 0) {
+    fprintf(stderr, "Failed to watch connection: %s\n", strerror(errno));
+    close_connection(conn);
+  }
+}
+
+static void *run_worker(void *worker_args) {
+  struct Worker *worker = (struct Worker *)worker_args;
+  STATS_SET_THREAD(worker->id);
+  TRACE_THREAD(worker->id);
+
+  struct Connection *conn;
+  while ((conn = queue_pop()) != NULL) {
+    serve_connection(conn, worker->input_fd);
+  }
+  return NULL;
+}
+
+/// Creates the memory-backed file of each worker.
+/// @return 0 if every file was created, 1 otherwise.
+static int open_inputs(struct Worker *workers, int num_workers) {
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].input_fd = -1;
+  }
+  for (int i = 0; i < num_workers; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "/ems-input-%d-%d", (int)getpid(), i);
+    workers[i].input_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (workers[i].input_fd < 0) {
+      fprintf(stderr, "Failed to create shared memory %s: %s\n", name,
+              strerror(errno));
+      return 1;
+    }
+    // Only this worker uses the file, so the name can go right away.
+    shm_unlink(name);
+  }
+  return 0;
+}
+
+static int open_socket(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void accept_connection(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+    return;
+  }
+
+  if (atomic_fetch_add(&num_connections, 1) >= SERVER_MAX_CONNECTIONS) {
+    fprintf(stderr, "Too many connections\n");
+    close(fd);
+    atomic_fetch_sub(&num_connections, 1);
+    return;
+  }
+
+  struct Connection *conn = calloc(1, sizeof(struct Connection));
+  if (conn == NULL) {
+    fprintf(stderr, "Error allocating memory for connection\n");
+    close(fd);
+    atomic_fetch_sub(&num_connections, 1);
+    return;
+  }
+  conn->fd = fd;
+  pthread_mutex_lock(&connections_mutex);
+  conn->next = connections;
+  if (connections != NULL) {
+    connections->prev = conn;
+  }
+  connections = conn;
+  pthread_mutex_unlock(&connections_mutex);
+
+  if (watch(conn, EPOLL_CTL_ADD) != 0) {
+    fprintf(stderr, "Failed to watch connection: %s\n", strerror(errno));
+    close_connection(conn);
+  }
+}
+
+/// Waits for connections and commands until a stop signal arrives.
+static void event_loop(void) {
+  struct epoll_event events[64];
+  while (1) {
+    int ready = epoll_wait(epoll_fd, events, 64, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+      return;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      struct Connection *conn = events[i].data.ptr;
+      if (conn == &stopper) {
+        return;
+      } else if (conn == &listener) {
+        accept_connection(listener.fd);
+      } else {
+        queue_push(conn);
+      }
+    }
+  }
+}
+
+/// Closes whatever run_server opened, and removes the socket if it was bound.
+/// @param listen_fd Listening socket, -1 if it could not be opened.
+/// @param workers Workers, NULL if they could not be allocated. Their
+/// threads must have stopped.
+static void close_server(int listen_fd, const char *socket_path,
+                         struct Worker *workers, int num_workers) {
+  while (connections != NULL) {
+    close_connection(connections);
+  }
+  if (workers != NULL) {
+    for (int i = 0; i < num_workers; i++) {
+      if (workers[i].input_fd >= 0) {
+        close(workers[i].input_fd);
+      }
+    }
+    free(workers);
+  }
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (stop_pipe[i] >= 0) {
+      close(stop_pipe[i]);
+      stop_pipe[i] = -1;
+    }
+  }
+  ems_terminate();
+}
+
+int run_server(const char *socket_path, int num_workers,
+               unsigned int state_access_delay_ms) {
+  if (num_workers <= 0) {
+    fprintf(stderr, "Invalid number of workers\n");
+    return 1;
+  }
+
+  if (ems_init(state_access_delay_ms)) {
+    fprintf(stderr, "Failed to initialize EMS\n");
+    return 1;
+  }
+
+  int listen_fd = open_socket(socket_path);
+  struct Worker *workers = NULL;
+  if (listen_fd < 0 || pipe(stop_pipe) != 0 ||
+      (epoll_fd = epoll_create1(0)) < 0 ||
+      (workers = malloc((size_t)num_workers * sizeof(struct Worker))) ==
+          NULL ||
+      open_inputs(workers, num_workers) != 0) {
+    fprintf(stderr, "Failed to start server\n");
+    close_server(listen_fd, socket_path, workers, num_workers);
+    return 1;
+  }
+
+  listener.fd = listen_fd;
+  stopper.fd = stop_pipe[0];
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &listener};
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &stopper;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_pipe[0], &event);
+
+  struct sigaction action = {.sa_handler = handle_stop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  // A client closing its connection must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+
+  printf("Listening on %s with %d workers\n", socket_path, num_workers);
+  fflush(stdout);
+  event_loop();
+
+  pthread_mutex_lock(&queue.mutex);
+  queue.stopping = 1;
+  pthread_cond_broadcast(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  close_server(listen_fd, socket_path, workers, num_workers);
+  STATS_DUMP(socket_path);
+  TRACE_FLUSH_JOB(socket_path);
+  return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef EMS_SERVER_H
+#define EMS_SERVER_H
+
+/// Runs the EMS as a daemon that keeps its state in memory and serves the job
+/// file grammar over a UNIX domain socket, until SIGINT or SIGTERM.
+///
+/// Every command sent by a client is answered with its output, if any,
+/// followed by a status line: "OK" if it succeeded, "ERR" otherwise. A BATCH
+/// is also answered with a "BATCH" line listing the status of each of its
+/// reservations, in order. An epoll loop waits for readable connections and
+/// hands each one to a fixed pool of worker threads, one command at a time.
+/// The workers read without blocking and keep what a client sent until it
+/// makes up a whole line, or a whole BATCH or TXN, so a client that stops
+/// halfway through a command never holds a worker.
+/// @param socket_path Path of the socket to listen on.
+/// @param num_workers Number of worker threads.
+/// @param state_access_delay_ms State access delay in milliseconds.
+/// @return 0 if the server shut down cleanly, 1 otherwise.
+int run_server(const char *socket_path, int num_workers,
+               unsigned int state_access_delay_ms);
+
+#endif // EMS_SERVER_H
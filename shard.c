@@ -0,0 +1,902 @@
+#include "shard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "aux.h"
+#include "config.h"
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+#include "stats.h"
+#include "trace.h"
+
+/// Set in the flags of a TXN message to undo the transaction instead.
+#define SHARD_UNDO 1u
+/// Set in the flags of a RESERVE message whose seats are num_seats
+/// SeatRanges instead of rows and columns.
+#define SHARD_RANGES 2u
+
+/// Command sent by the router to a shard. It is followed by num_reservations
+/// entries, then the rows and then the columns of the num_seats seats.
+struct ShardMessage {
+  uint64_t seq;              /// Position of the command in the output.
+  uint32_t cmd;              /// enum Command.
+  uint32_t flags;            /// SHARD_UNDO, SHARD_RANGES.
+  uint32_t event_id;         /// CREATE, CANCEL, DELETE and SHOW.
+  uint32_t reservation_id;   /// CANCEL.
+  uint64_t num_rows;         /// CREATE.
+  uint64_t num_cols;         /// CREATE.
+  uint32_t num_reservations; /// RESERVE, BATCH and TXN.
+  uint32_t num_seats;        /// Seats of all the reservations.
+};
+
+/// A reservation of a RESERVE, BATCH or TXN message.
+struct ShardEntry {
+  uint32_t event_id;
+  uint32_t num_seats;
+};
+
+/// Answer of a shard to a message, followed by len bytes of output.
+struct ShardReply {
+  uint64_t seq;
+  uint32_t status; /// 0 if the command succeeded, 1 otherwise.
+  uint32_t len;
+};
+
+/// State of a shard process, shared by its threads.
+struct Shard {
+  int fd_in;  /// Read end of the command pipe.
+  int fd_out; /// Write end of the reply pipe.
+  pthread_mutex_t read_mutex;
+  pthread_mutex_t write_mutex;
+};
+
+struct ShardWorker {
+  pthread_t thread;
+  int id;
+  struct Shard *shard;
+};
+
+/// A command sent to the shards, waiting for their replies.
+struct Slot {
+  int pending; /// Replies still expected.
+  int failed;  /// Set if the command failed on any shard.
+  enum Command cmd;
+  unsigned int event_id;
+  char *output; /// Output received so far, NULL if none.
+  size_t len;
+};
+
+/// State of the router process.
+struct Router {
+  int num_shards;
+  int fd_out;
+  int to_shard[MAX_SHARDS];   /// Write end of the command pipe of every shard.
+  int from_shard[MAX_SHARDS]; /// Read end of the reply pipe of every shard.
+  pid_t pids[MAX_SHARDS];
+  pthread_t merger;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t progress; /// Signaled whenever a command is written out.
+  uint64_t next_seq;       /// Sequence number of the next command.
+  uint64_t emitted;        /// Commands whose output was written out.
+  int closing;             /// Set once the command pipes are closed.
+  int broken;              /// Set if a shard exited early.
+  struct Slot slots[SHARD_WINDOW];
+
+  /// Events created by the shards and not deleted, in creation order.
+  unsigned int *catalog;
+  size_t catalog_size;
+  size_t catalog_capacity;
+
+  /// Reservations of a BATCH or TXN being sent to a shard.
+  struct ShardEntry entries[MAX_BATCH_SIZE];
+  size_t xs[MAX_BATCH_SEATS];
+  size_t ys[MAX_BATCH_SEATS];
+};
+
+/// Reads exactly len bytes.
+/// @return 0 on success, 1 at end of file or on error.
+static int read_all(int fd, void *buf, size_t len) {
+  char *ptr = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, ptr, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    ptr += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/// Gets the shard that owns an event.
+static int shard_of(unsigned int event_id, int num_shards) {
+  return (int)((uint32_t)(event_id * 2654435761u) % (uint32_t)num_shards);
+}
+
+/// Reads the next message of the router.
+/// @return 0 if a message was read, 1 at end of file or on error.
+static int receive_request(int fd, struct Request *req, uint64_t *seq,
+                           uint32_t *flags) {
+  struct ShardMessage msg;
+  if (read_all(fd, &msg, sizeof(msg)) != 0) {
+    return 1;
+  }
+  if (msg.num_reservations > MAX_BATCH_SIZE) {
+    fprintf(stderr, "Invalid shard message\n");
+    return 1;
+  }
+
+  *seq = msg.seq;
+  *flags = msg.flags;
+  req->cmd = (enum Command)msg.cmd;
+  req->event_id = msg.event_id;
+  req->reservation_id = msg.reservation_id;
+  req->num_rows = (size_t)msg.num_rows;
+  req->num_cols = (size_t)msg.num_cols;
+
+  struct ShardEntry entries[MAX_BATCH_SIZE];
+  if (read_all(fd, entries, msg.num_reservations * sizeof(struct ShardEntry))) {
+    return 1;
+  }
+
+  if (msg.flags & SHARD_RANGES) {
+    if (req->cmd != CMD_RESERVE || reserve_buffers(req) != 0 ||
+        msg.num_seats > config_get()->max_reservation ||
+        read_all(fd, req->ranges, msg.num_seats * sizeof(struct SeatRange))) {
+      fprintf(stderr, "Invalid shard message\n");
+      return 1;
+    }
+    req->num_ranges = msg.num_seats;
+    req->num_coords = 0;
+    return 0;
+  }
+
+  if (reserve_buffers(req) != 0) {
+    return 1;
+  }
+  size_t *xs = req->xs;
+  size_t *ys = req->ys;
+  if (req->cmd == CMD_BATCH || req->cmd == CMD_TXN) {
+    if (msg.num_seats > MAX_BATCH_SEATS) {
+      fprintf(stderr, "Invalid shard message\n");
+      return 1;
+    }
+    if (req->batch == NULL) {
+      req->batch = malloc(sizeof(struct Batch));
+      if (req->batch == NULL) {
+        fprintf(stderr, "Error allocating memory for batch\n");
+        return 1;
+      }
+    }
+    xs = req->batch->xs;
+    ys = req->batch->ys;
+  } else if (msg.num_seats > config_get()->max_reservation) {
+    fprintf(stderr, "Invalid shard message\n");
+    return 1;
+  }
+
+  if (read_all(fd, xs, msg.num_seats * sizeof(size_t)) != 0 ||
+      read_all(fd, ys, msg.num_seats * sizeof(size_t)) != 0) {
+    return 1;
+  }
+  req->num_coords = msg.num_seats;
+
+  if (req->batch != NULL && (req->cmd == CMD_BATCH || req->cmd == CMD_TXN)) {
+    size_t offset = 0;
+    for (uint32_t i = 0; i < msg.num_reservations; i++) {
+      if (entries[i].num_seats > msg.num_seats - offset) {
+        fprintf(stderr, "Invalid shard message\n");
+        return 1;
+      }
+      req->batch->reservations[i] = (struct Reservation){
+          entries[i].event_id, entries[i].num_seats, &xs[offset], &ys[offset]};
+      offset += entries[i].num_seats;
+    }
+    req->batch->num_reservations = msg.num_reservations;
+    req->batch->num_seats = offset;
+  }
+  return 0;
+}
+
+static void *run_shard_worker(void *worker_args) {
+  struct ShardWorker *worker = (struct ShardWorker *)worker_args;
+  struct Shard *shard = worker->shard;
+  STATS_SET_THREAD(worker->id);
+  TRACE_THREAD(worker->id);
+
+  struct Request req = {0};
+  while (1) {
+    uint64_t seq;
+    uint32_t flags;
+    pthread_mutex_lock(&shard->read_mutex);
+    int done = receive_request(shard->fd_in, &req, &seq, &flags);
+    pthread_mutex_unlock(&shard->read_mutex);
+    if (done) {
+      break;
+    }
+
+    STATS_START(start);
+    TRACE_START(trace_start);
+    STATS_SET_CONTEXT(req.cmd, (int)seq);
+    output_capture_begin();
+    int result;
+    if (flags & SHARD_UNDO) {
+      result = ems_undo_txn(req.batch->num_reservations,
+                            req.batch->reservations);
+    } else {
+      result = execute_request(&req, -1);
+    }
+    size_t len;
+    char *output = output_capture_end(&len);
+    STATS_RECORD_COMMAND(req.cmd, 1, start);
+    TRACE_COMPLETE(command_name(req.cmd), trace_start, (long)seq);
+
+    struct ShardReply reply = {seq, (uint32_t)(result != 0 || output == NULL),
+                               (uint32_t)len};
+    struct iovec iov[2] = {{&reply, sizeof(reply)}, {output, len}};
+    pthread_mutex_lock(&shard->write_mutex);
+    int failed = writev_all(shard->fd_out, iov, len > 0 ? 2 : 1);
+    pthread_mutex_unlock(&shard->write_mutex);
+    free(output);
+    if (failed) {
+      fprintf(stderr, "Failed to reply to the router: %s\n", strerror(errno));
+      break;
+    }
+  }
+
+  free_request(&req);
+  return NULL;
+}
+
+/// Executes the commands of the router until it closes the command pipe.
+static int run_shard(int fd_in, int fd_out, const char *label,
+                     unsigned int state_access_delay_ms, int max_threads) {
+  (void)label; // Only used by the stats and trace hooks
+  if (ems_init(state_access_delay_ms)) {
+    fprintf(stderr, "Failed to initialize EMS\n");
+    return 1;
+  }
+
+  struct Shard shard = {fd_in, fd_out, PTHREAD_MUTEX_INITIALIZER,
+                        PTHREAD_MUTEX_INITIALIZER};
+  struct ShardWorker *workers =
+      malloc((size_t)max_threads * sizeof(struct ShardWorker));
+  if (workers == NULL) {
+    fprintf(stderr, "Error allocating memory for shard workers\n");
+    ems_terminate();
+    return 1;
+  }
+  for (int i = 0; i < max_threads; i++) {
+    workers[i].id = i;
+    workers[i].shard = &shard;
+    pthread_create(&workers[i].thread, NULL, run_shard_worker, &workers[i]);
+  }
+  for (int i = 0; i < max_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  free(workers);
+
+  ems_terminate();
+  STATS_DUMP(label);
+  TRACE_FLUSH_JOB(label);
+  return 0;
+}
+
+/// Adds or removes an event from the catalog after a CREATE or DELETE.
+/// @note The caller must hold the router mutex.
+static void update_catalog(struct Router *router, const struct Slot *slot) {
+  if (slot->cmd == CMD_CREATE) {
+    if (router->catalog_size == router->catalog_capacity) {
+      size_t capacity =
+          router->catalog_capacity ? router->catalog_capacity * 2 : 16;
+      unsigned int *catalog =
+          realloc(router->catalog, capacity * sizeof(unsigned int));
+      if (catalog == NULL) {
+        fprintf(stderr, "Error allocating memory for catalog\n");
+        return;
+      }
+      router->catalog = catalog;
+      router->catalog_capacity = capacity;
+    }
+    router->catalog[router->catalog_size++] = slot->event_id;
+  } else if (slot->cmd == CMD_DELETE) {
+    for (size_t i = 0; i < router->catalog_size; i++) {
+      if (router->catalog[i] == slot->event_id) {
+        memmove(&router->catalog[i], &router->catalog[i + 1],
+                (router->catalog_size - i - 1) * sizeof(unsigned int));
+        router->catalog_size--;
+        break;
+      }
+    }
+  }
+}
+
+/// Records a reply and writes out every command that is complete, in order.
+/// @note Only the merger calls it, so the outputs are written without the
+/// mutex: the slots being written are complete and, until emitted moves past
+/// them, neither reused nor freed.
+static void receive_reply(struct Router *router, const struct ShardReply *reply,
+                          char *output) {
+  pthread_mutex_lock(&router->mutex);
+  struct Slot *slot = &router->slots[reply->seq % SHARD_WINDOW];
+  if (output != NULL) {
+    if (slot->output == NULL) {
+      slot->output = output;
+      slot->len = reply->len;
+    } else {
+      char *joined = realloc(slot->output, slot->len + reply->len + 1);
+      if (joined == NULL) {
+        fprintf(stderr, "Error allocating memory for output\n");
+      } else {
+        memcpy(joined + slot->len, output, (size_t)reply->len + 1);
+        slot->output = joined;
+        slot->len += reply->len;
+      }
+      free(output);
+    }
+  }
+  slot->failed |= reply->status != 0;
+  slot->pending--;
+
+  while (1) {
+    struct iovec iov[MAX_OUTPUT_IOVECS];
+    int iovcnt = 0;
+    uint64_t end = router->emitted;
+    while (end < router->next_seq && iovcnt < MAX_OUTPUT_IOVECS) {
+      slot = &router->slots[end % SHARD_WINDOW];
+      if (slot->pending > 0) {
+        break;
+      }
+      if (slot->output != NULL) {
+        iov[iovcnt++] = (struct iovec){slot->output, slot->len};
+      }
+      end++;
+    }
+    if (end == router->emitted) {
+      break;
+    }
+
+    if (iovcnt > 0) {
+      pthread_mutex_unlock(&router->mutex);
+      STATS_START(start);
+      if (writev_all(router->fd_out, iov, iovcnt) != 0) {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+      }
+      STATS_RECORD(STATS_WRITE, start);
+      pthread_mutex_lock(&router->mutex);
+    }
+
+    for (; router->emitted < end; router->emitted++) {
+      slot = &router->slots[router->emitted % SHARD_WINDOW];
+      free(slot->output);
+      slot->output = NULL;
+      if (!slot->failed) {
+        update_catalog(router, slot);
+      }
+    }
+    pthread_cond_broadcast(&router->progress);
+  }
+  pthread_mutex_unlock(&router->mutex);
+}
+
+/// Reads the replies of the shards until every one closes its pipe.
+static void *run_merger(void *router_args) {
+  struct Router *router = (struct Router *)router_args;
+  TRACE_THREAD(-2);
+
+  struct pollfd fds[MAX_SHARDS];
+  for (int i = 0; i < router->num_shards; i++) {
+    fds[i] = (struct pollfd){.fd = router->from_shard[i], .events = POLLIN};
+  }
+
+  int open = router->num_shards;
+  while (open > 0) {
+    if (poll(fds, (nfds_t)router->num_shards, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < router->num_shards; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) {
+        continue;
+      }
+
+      struct ShardReply reply;
+      char *output = NULL;
+      int eof = read_all(fds[i].fd, &reply, sizeof(reply)) != 0;
+      if (!eof && reply.len > 0) {
+        output = malloc((size_t)reply.len + 1);
+        if (output == NULL ||
+            read_all(fds[i].fd, output, reply.len) != 0) {
+          free(output);
+          eof = 1;
+        } else {
+          output[reply.len] = '\0';
+        }
+      }
+
+      if (eof) {
+        fds[i].fd = -1;
+        open--;
+        pthread_mutex_lock(&router->mutex);
+        if (!router->closing) {
+          fprintf(stderr, "Shard %d exited before the end of the job file\n",
+                  i);
+          router->broken = 1;
+          pthread_cond_broadcast(&router->progress);
+        }
+        pthread_mutex_unlock(&router->mutex);
+        continue;
+      }
+      receive_reply(router, &reply, output);
+    }
+  }
+
+  if (open > 0) {
+    pthread_mutex_lock(&router->mutex);
+    router->broken = 1;
+    pthread_cond_broadcast(&router->progress);
+    pthread_mutex_unlock(&router->mutex);
+  }
+  return NULL;
+}
+
+/// Reserves the slot of the next command, waiting while the window is full.
+/// @param pending Number of replies the command waits for.
+/// @return Sequence number of the command, UINT64_MAX if a shard failed.
+static uint64_t begin_command(struct Router *router, enum Command cmd,
+                              unsigned int event_id, int pending) {
+  pthread_mutex_lock(&router->mutex);
+  while (router->next_seq - router->emitted >= SHARD_WINDOW &&
+         !router->broken) {
+    pthread_cond_wait(&router->progress, &router->mutex);
+  }
+  uint64_t seq = UINT64_MAX;
+  if (!router->broken) {
+    seq = router->next_seq++;
+    router->slots[seq % SHARD_WINDOW] =
+        (struct Slot){pending, 0, cmd, event_id, NULL, 0};
+  }
+  pthread_mutex_unlock(&router->mutex);
+  return seq;
+}
+
+/// Waits until every command sent has been written out.
+/// @return 0 on success, 1 if a shard failed.
+static int drain(struct Router *router) {
+  pthread_mutex_lock(&router->mutex);
+  while (router->emitted < router->next_seq && !router->broken) {
+    pthread_cond_wait(&router->progress, &router->mutex);
+  }
+  int broken = router->broken;
+  pthread_mutex_unlock(&router->mutex);
+  return broken;
+}
+
+static int send_message(struct Router *router, int shard,
+                        struct ShardMessage *msg,
+                        const struct ShardEntry *entries, const size_t *xs,
+                        const size_t *ys) {
+  struct iovec iov[4] = {
+      {msg, sizeof(*msg)},
+      {(void *)entries, msg->num_reservations * sizeof(struct ShardEntry)},
+      {(void *)xs, msg->num_seats * sizeof(size_t)},
+      {(void *)ys, msg->num_seats * sizeof(size_t)}};
+  if (writev_all(router->to_shard[shard], iov, msg->num_seats > 0 ? 4 : 1)) {
+    fprintf(stderr, "Failed to send command to shard %d: %s\n", shard,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/// Sends a command about a single event to the shard that owns it.
+static int send_request(struct Router *router, const struct Request *req) {
+  int shard = shard_of(req->event_id, router->num_shards);
+  uint64_t seq = begin_command(router, req->cmd, req->event_id, 1);
+  if (seq == UINT64_MAX) {
+    return 1;
+  }
+
+  struct ShardMessage msg = {.seq = seq,
+                             .cmd = (uint32_t)req->cmd,
+                             .event_id = req->event_id,
+                             .reservation_id = req->reservation_id,
+                             .num_rows = req->num_rows,
+                             .num_cols = req->num_cols};
+  struct ShardEntry entry = {req->event_id, (uint32_t)req->num_coords};
+  if (req->cmd == CMD_RESERVE && req->num_coords == 0) {
+    msg.flags = SHARD_RANGES;
+    msg.num_seats = (uint32_t)req->num_ranges;
+    struct iovec iov[2] = {
+        {&msg, sizeof(msg)},
+        {(void *)req->ranges, req->num_ranges * sizeof(struct SeatRange)}};
+    if (writev_all(router->to_shard[shard], iov, 2)) {
+      fprintf(stderr, "Failed to send command to shard %d: %s\n", shard,
+              strerror(errno));
+      return 1;
+    }
+    return 0;
+  }
+  if (req->cmd == CMD_RESERVE) {
+    msg.num_reservations = 1;
+    msg.num_seats = (uint32_t)req->num_coords;
+  }
+  return send_message(router, shard, &msg, &entry, req->xs, req->ys);
+}
+
+/// Gathers the reservations of a batch that belong to a shard in the
+/// router buffers.
+/// @return Number of reservations gathered.
+static uint32_t gather_reservations(struct Router *router, int shard,
+                                    const struct Batch *batch,
+                                    uint32_t *num_seats) {
+  uint32_t count = 0;
+  *num_seats = 0;
+  for (size_t i = 0; i < batch->num_reservations; i++) {
+    const struct Reservation *reservation = &batch->reservations[i];
+    if (shard_of(reservation->event_id, router->num_shards) != shard) {
+      continue;
+    }
+    router->entries[count++] = (struct ShardEntry){
+        reservation->event_id, (uint32_t)reservation->num_seats};
+    memcpy(&router->xs[*num_seats], reservation->xs,
+           reservation->num_seats * sizeof(size_t));
+    memcpy(&router->ys[*num_seats], reservation->ys,
+           reservation->num_seats * sizeof(size_t));
+    *num_seats += (uint32_t)reservation->num_seats;
+  }
+  return count;
+}
+
+/// Sends the reservations of a batch that belong to a shard, if any.
+static int send_reservations(struct Router *router, int shard, uint64_t seq,
+                             enum Command cmd, uint32_t flags,
+                             const struct Batch *batch) {
+  struct ShardMessage msg = {.seq = seq, .cmd = (uint32_t)cmd, .flags = flags};
+  msg.num_reservations =
+      gather_reservations(router, shard, batch, &msg.num_seats);
+  if (msg.num_reservations == 0) {
+    return 0;
+  }
+  return send_message(router, shard, &msg, router->entries, router->xs,
+                      router->ys);
+}
+
+/// Tells which shards own at least one event of a batch.
+/// @return Number of shards involved.
+static int involved_shards(struct Router *router, const struct Batch *batch,
+                           int *involved) {
+  memset(involved, 0, (size_t)router->num_shards * sizeof(int));
+  int count = 0;
+  for (size_t i = 0; i < batch->num_reservations; i++) {
+    int shard = shard_of(batch->reservations[i].event_id, router->num_shards);
+    if (!involved[shard]) {
+      involved[shard] = 1;
+      count++;
+    }
+  }
+  return count;
+}
+
+/// Sends the reservations of a BATCH, or of a TXN within a single shard, as
+/// one command with a reply from every shard involved.
+static int send_batch(struct Router *router, const struct Request *req) {
+  int involved[MAX_SHARDS];
+  int count = involved_shards(router, req->batch, involved);
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t seq = begin_command(router, req->cmd, 0, count);
+  if (seq == UINT64_MAX) {
+    return 1;
+  }
+  for (int i = 0; i < router->num_shards; i++) {
+    if (involved[i] &&
+        send_reservations(router, i, seq, req->cmd, 0, req->batch) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Runs a TXN spanning several shards while no other command is in flight,
+/// so that no command sees it half applied, and undoes it on the shards
+/// where it succeeded if it failed on any other.
+static int run_cross_shard_txn(struct Router *router, const struct Batch *batch) {
+  int involved[MAX_SHARDS];
+  uint64_t seqs[MAX_SHARDS];
+  involved_shards(router, batch, involved);
+
+  if (drain(router) != 0) {
+    return 1;
+  }
+  for (int i = 0; i < router->num_shards; i++) {
+    if (!involved[i]) {
+      continue;
+    }
+    seqs[i] = begin_command(router, CMD_TXN, 0, 1);
+    if (seqs[i] == UINT64_MAX ||
+        send_reservations(router, i, seqs[i], CMD_TXN, 0, batch) != 0) {
+      return 1;
+    }
+  }
+  if (drain(router) != 0) {
+    return 1;
+  }
+
+  int failed = 0;
+  int applied[MAX_SHARDS];
+  pthread_mutex_lock(&router->mutex);
+  for (int i = 0; i < router->num_shards; i++) {
+    applied[i] = involved[i] && !router->slots[seqs[i] % SHARD_WINDOW].failed;
+    failed |= involved[i] && !applied[i];
+  }
+  pthread_mutex_unlock(&router->mutex);
+  if (!failed) {
+    return 0;
+  }
+
+  for (int i = 0; i < router->num_shards; i++) {
+    if (!applied[i]) {
+      continue;
+    }
+    uint64_t seq = begin_command(router, CMD_TXN, 0, 1);
+    if (seq == UINT64_MAX ||
+        send_reservations(router, i, seq, CMD_TXN, SHARD_UNDO, batch) != 0) {
+      return 1;
+    }
+  }
+  return drain(router);
+}
+
+/// Writes the events of the catalog, once every command before is done.
+static int list_events(struct Router *router) {
+  if (drain(router) != 0) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&router->mutex);
+  if (router->catalog_size == 0) {
+    mywrite(router->fd_out, "No events\n");
+  }
+  for (size_t i = 0; i < router->catalog_size; i++) {
+    char id[64];
+    sprintf(id, "Event: %u\n", router->catalog[i]);
+    mywrite(router->fd_out, id);
+  }
+  pthread_mutex_unlock(&router->mutex);
+  return 0;
+}
+
+/// Routes every command of the job file to the shards.
+/// @return 0 on success, 1 if a shard failed.
+static int route_file(struct Router *router, int fd_in) {
+  struct Request req = {0};
+  int line = 0;
+  int failed = 0;
+  while (!failed) {
+    enum Command cmd = read_request(fd_in, &line, &req);
+    if (cmd == EOC) {
+      break;
+    }
+
+    switch (cmd) {
+    case CMD_CREATE:
+    case CMD_RESERVE:
+    case CMD_CANCEL:
+    case CMD_DELETE:
+    case CMD_SHOW:
+      failed = send_request(router, &req);
+      break;
+    case CMD_BATCH:
+      failed = send_batch(router, &req);
+      break;
+    case CMD_TXN: {
+      int involved[MAX_SHARDS];
+      if (involved_shards(router, req.batch, involved) > 1) {
+        failed = run_cross_shard_txn(router, req.batch);
+      } else {
+        failed = send_batch(router, &req);
+      }
+      break;
+    }
+    case CMD_LIST_EVENTS:
+      failed = list_events(router);
+      break;
+    case CMD_BARRIER:
+      failed = drain(router);
+      break;
+    case CMD_WAIT:
+      if (req.delay > 0) {
+        printf("Waiting...\n");
+        ems_wait(req.delay);
+      }
+      break;
+    case CMD_HELP:
+      // Printed by the router, so only once the earlier commands are written
+      // out.
+      failed = drain(router);
+      if (!failed) {
+        execute_request(&req, router->fd_out);
+      }
+      break;
+    case CMD_END:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      // Nothing is written to fd_out.
+      execute_request(&req, router->fd_out);
+      break;
+    }
+  }
+
+  free_request(&req);
+  return failed || drain(router);
+}
+
+/// Builds the name the stats and trace of a shard are reported under:
+/// <job>.shard<index>.jobs
+static void shard_label(const char *filein, int index, char *label,
+                        size_t size) {
+  size_t len = strlen(filein);
+  size_t ext_len = strlen(INPUT_EXTENSION);
+  if (len >= ext_len && strcmp(filein + len - ext_len, INPUT_EXTENSION) == 0) {
+    len -= ext_len;
+  }
+  snprintf(label, size, "%.*s.shard%d%s", (int)len, filein, index,
+           INPUT_EXTENSION);
+}
+
+/// Forks the shard processes, connected to the router by a pair of pipes.
+/// @return Number of shards started.
+static int start_shards(struct Router *router, const char *filein,
+                        unsigned int state_access_delay_ms, int max_threads) {
+  fflush(stdout);
+  for (int i = 0; i < router->num_shards; i++) {
+    int commands[2], replies[2];
+    if (pipe(commands) != 0) {
+      return i;
+    }
+    if (pipe(replies) != 0) {
+      close(commands[0]);
+      close(commands[1]);
+      return i;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(commands[0]);
+      close(commands[1]);
+      close(replies[0]);
+      close(replies[1]);
+      return i;
+    }
+
+    if (pid == 0) {
+      TRACE_RESET();
+      // Keep only this shard's ends, so that every shard sees the end of its
+      // command pipe once the router closes it.
+      for (int j = 0; j < i; j++) {
+        close(router->to_shard[j]);
+        close(router->from_shard[j]);
+      }
+      close(commands[1]);
+      close(replies[0]);
+      close(router->fd_out);
+      free(router);
+
+      char label[1024];
+      shard_label(filein, i, label, sizeof(label));
+      exit(run_shard(commands[0], replies[1], label, state_access_delay_ms,
+                     max_threads));
+    }
+
+    close(commands[0]);
+    close(replies[1]);
+    router->to_shard[i] = commands[1];
+    router->from_shard[i] = replies[0];
+    router->pids[i] = pid;
+  }
+  return router->num_shards;
+}
+
+/// Closes the command pipes and waits for the shards and the merger.
+/// @return 0 if every shard exited cleanly, 1 otherwise.
+static int stop_shards(struct Router *router, int started, int merging) {
+  pthread_mutex_lock(&router->mutex);
+  router->closing = 1;
+  pthread_mutex_unlock(&router->mutex);
+
+  for (int i = 0; i < started; i++) {
+    close(router->to_shard[i]);
+  }
+  if (merging) {
+    pthread_join(router->merger, NULL);
+  }
+
+  int failed = 0;
+  for (int i = 0; i < started; i++) {
+    int status;
+    close(router->from_shard[i]);
+    if (waitpid(router->pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+int execute_file_sharded(char *filein, int fd_out,
+                         unsigned int state_access_delay_ms, int max_threads,
+                         int num_shards) {
+  if (num_shards <= 0 || num_shards > MAX_SHARDS || max_threads <= 0) {
+    fprintf(stderr, "Invalid number of shards or threads\n");
+    return 1;
+  }
+
+  struct Router *router = calloc(1, sizeof(struct Router));
+  if (router == NULL) {
+    fprintf(stderr, "Error allocating memory for router\n");
+    return 1;
+  }
+  router->num_shards = num_shards;
+  router->fd_out = fd_out;
+  pthread_mutex_init(&router->mutex, NULL);
+  pthread_cond_init(&router->progress, NULL);
+
+  // A shard exiting early must not kill the router while it sends commands.
+  signal(SIGPIPE, SIG_IGN);
+
+  int started =
+      start_shards(router, filein, state_access_delay_ms, max_threads);
+  int failed = started < num_shards;
+  int merging = 0;
+  if (failed) {
+    fprintf(stderr, "Failed to start shards: %s\n", strerror(errno));
+  } else if (pthread_create(&router->merger, NULL, run_merger, router) != 0) {
+    fprintf(stderr, "Failed to start merger\n");
+    failed = 1;
+  } else {
+    merging = 1;
+    int fd_in = open(filein, O_RDONLY);
+    if (fd_in < 0) {
+      fprintf(stderr, "Failed to open %s: %s\n", filein, strerror(errno));
+      failed = 1;
+    } else {
+      failed = route_file(router, fd_in);
+      close(fd_in);
+    }
+  }
+
+  failed |= stop_shards(router, started, merging);
+
+  for (size_t i = 0; i < SHARD_WINDOW; i++) {
+    free(router->slots[i].output);
+  }
+  free(router->catalog);
+  pthread_cond_destroy(&router->progress);
+  pthread_mutex_destroy(&router->mutex);
+  free(router);
+  return failed;
+}
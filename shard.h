@@ -0,0 +1,27 @@
+#ifndef EMS_SHARD_H
+#define EMS_SHARD_H
+
+/// Executes a job file across several processes, each one owning the events
+/// whose id hashes to it.
+///
+/// The calling process becomes a router: it parses the job file and sends
+/// every command over a pipe to the shard that owns its event. BATCHes are
+/// split by shard. Each shard runs its own EMS state with max_threads
+/// threads and answers every command with its result and output. A merger
+/// thread in the router writes the outputs to fd_out in the order of the job
+/// file. LIST is answered by the router from the events the shards
+/// created, and BARRIER waits for every shard to catch up. A TXN spanning
+/// several shards is run while no other command is in flight, and undone on
+/// the shards where it succeeded if it failed on any other.
+/// @param filein Path of the job file.
+/// @param fd_out File descriptor of the output file.
+/// @param state_access_delay_ms State access delay in milliseconds.
+/// @param max_threads Number of threads of every shard.
+/// @param num_shards Number of shard processes.
+/// @return 0 if the job file was executed, 1 if the shards could not be
+/// started or one of them failed.
+int execute_file_sharded(char *filein, int fd_out,
+                         unsigned int state_access_delay_ms, int max_threads,
+                         int num_shards);
+
+#endif // EMS_SHARD_H
@@ -0,0 +1,439 @@
+#include "stats.h"
+
+#ifdef EMS_STATS
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Histograms are log-linear (HDR-style): values below 2^SUB_BITS get one
+/// bucket each, and every power of two above is split into 2^SUB_BITS
+/// buckets, giving a relative error of at most 1/2^SUB_BITS.
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+#define NUM_COMMANDS (EOC + 1)
+#define NUM_HISTOGRAMS (NUM_COMMANDS + STATS_NUM_METRICS)
+#define MAX_HELD_LOCKS 8
+
+struct Histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[NUM_BUCKETS];
+};
+
+struct HeldLock {
+  const void *lock;
+  uint64_t acquired;
+};
+
+struct ThreadStats {
+  int thread_id;
+  int cmd;           /// Command being executed, -1 if none.
+  int line;          /// Line of the command being executed.
+  uint64_t commands; /// Commands executed by the thread.
+  uint64_t busy_ns;  /// Time spent executing them.
+  size_t num_held;
+  struct HeldLock held[MAX_HELD_LOCKS];
+  struct Histogram histograms[NUM_HISTOGRAMS];
+};
+
+struct ThreadSummary {
+  int thread_id;
+  uint64_t commands;
+  uint64_t busy_ns;
+};
+
+static const char *metric_names[STATS_NUM_METRICS] = {
+    [STATS_PARSE] = "parse_only",
+    [STATS_LOCK_WAIT] = "lock_wait",
+    [STATS_LOCK_HOLD] = "lock_hold",
+    [STATS_DELAY] = "delay",
+    [STATS_WRITE] = "write"};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static int enabled = 0;
+static int json = 0;
+
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct Histogram totals[NUM_HISTOGRAMS];
+static struct ThreadSummary *summaries = NULL;
+static size_t num_summaries = 0;
+
+static _Thread_local struct ThreadStats *local = NULL;
+
+static void thread_destructor(void *data) {
+  (void)data;
+  stats_thread_flush();
+}
+
+static void stats_setup(void) {
+  const char *mode = getenv("EMS_STATS");
+  if (mode == NULL || *mode == '\0' || strcmp(mode, "0") == 0) {
+    return;
+  }
+
+  json = strcmp(mode, "json") == 0;
+  if (pthread_key_create(&stats_key, thread_destructor) != 0) {
+    fprintf(stderr, "Failed to set up statistics\n");
+    return;
+  }
+  enabled = 1;
+}
+
+int stats_enabled(void) {
+  pthread_once(&stats_once, stats_setup);
+  return enabled;
+}
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/// Gets the statistics of the calling thread, allocating them if needed.
+/// @return Pointer to the thread statistics, NULL on failure.
+static struct ThreadStats *thread_stats(void) {
+  if (local != NULL) {
+    return local;
+  }
+
+  local = calloc(1, sizeof(struct ThreadStats));
+  if (local == NULL) {
+    return NULL;
+  }
+  local->thread_id = -1;
+  local->cmd = -1;
+  // The key is only used to get the destructor called on thread exit.
+  pthread_setspecific(stats_key, local);
+  return local;
+}
+
+static size_t bucket_index(uint64_t value) {
+  if (value < SUB_COUNT) {
+    return (size_t)value;
+  }
+
+  unsigned int msb = 63U - (unsigned int)__builtin_clzll(value);
+  unsigned int shift = msb - SUB_BITS;
+  return (size_t)(msb - SUB_BITS + 1) * SUB_COUNT +
+         (size_t)((value >> shift) & (SUB_COUNT - 1));
+}
+
+/// Gets the value in the middle of a bucket.
+static uint64_t bucket_value(size_t index) {
+  if (index < SUB_COUNT) {
+    return (uint64_t)index;
+  }
+
+  unsigned int shift = (unsigned int)(index / SUB_COUNT) - 1;
+  uint64_t low = (uint64_t)(SUB_COUNT + index % SUB_COUNT) << shift;
+  return low + ((1ULL << shift) >> 1);
+}
+
+static void histogram_add(struct Histogram *histogram, uint64_t value) {
+  if (histogram->count == 0 || value < histogram->min) {
+    histogram->min = value;
+  }
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+  histogram->count++;
+  histogram->sum += value;
+  histogram->buckets[bucket_index(value)]++;
+}
+
+static void histogram_merge(struct Histogram *into,
+                            const struct Histogram *from) {
+  if (from->count == 0) {
+    return;
+  }
+  if (into->count == 0 || from->min < into->min) {
+    into->min = from->min;
+  }
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+  for (size_t i = 0; i < NUM_BUCKETS; i++) {
+    into->buckets[i] += from->buckets[i];
+  }
+}
+
+static uint64_t histogram_percentile(const struct Histogram *histogram,
+                                     unsigned int percentile) {
+  uint64_t rank = (histogram->count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NUM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t value = bucket_value(i);
+      if (value < histogram->min) {
+        return histogram->min;
+      }
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+  return histogram->max;
+}
+
+void stats_set_thread(int thread_id) {
+  if (!stats_enabled()) {
+    return;
+  }
+  struct ThreadStats *stats = thread_stats();
+  if (stats != NULL) {
+    stats->thread_id = thread_id;
+  }
+}
+
+void stats_record_command(enum Command cmd, int owned, uint64_t start) {
+  struct ThreadStats *stats = thread_stats();
+  if (stats == NULL) {
+    return;
+  }
+
+  uint64_t elapsed = stats_now() - start;
+  if (!owned) {
+    histogram_add(&stats->histograms[NUM_COMMANDS + STATS_PARSE], elapsed);
+    return;
+  }
+
+  histogram_add(&stats->histograms[cmd], elapsed);
+  stats->commands++;
+  stats->busy_ns += elapsed;
+}
+
+void stats_record(enum StatsMetric metric, uint64_t start) {
+  struct ThreadStats *stats = thread_stats();
+  if (stats != NULL) {
+    histogram_add(&stats->histograms[NUM_COMMANDS + metric],
+                  stats_now() - start);
+  }
+}
+
+void stats_set_context(enum Command cmd, int line) {
+  struct ThreadStats *stats = thread_stats();
+  if (stats != NULL) {
+    stats->cmd = (int)cmd;
+    stats->line = line;
+  }
+}
+
+void stats_get_context(int *cmd, int *line) {
+  struct ThreadStats *stats = enabled ? local : NULL;
+  *cmd = stats != NULL ? stats->cmd : -1;
+  *line = stats != NULL ? stats->line : 0;
+}
+
+const char *stats_command_name(int cmd) {
+  if (cmd < 0 || cmd >= NUM_COMMANDS) {
+    return "none";
+  }
+  return command_name((enum Command)cmd);
+}
+
+void stats_lock_acquired(const void *lock, uint64_t start) {
+  uint64_t acquired = stats_now();
+  struct ThreadStats *stats = thread_stats();
+  if (stats == NULL) {
+    return;
+  }
+
+  histogram_add(&stats->histograms[NUM_COMMANDS + STATS_LOCK_WAIT],
+                acquired - start);
+  if (stats->num_held < MAX_HELD_LOCKS) {
+    stats->held[stats->num_held++] = (struct HeldLock){lock, acquired};
+  }
+}
+
+void stats_lock_released(const void *lock) {
+  struct ThreadStats *stats = enabled ? local : NULL;
+  if (stats == NULL) {
+    return;
+  }
+
+  // Locks are usually released in reverse order, so search from the top.
+  for (size_t i = stats->num_held; i > 0; i--) {
+    if (stats->held[i - 1].lock == lock) {
+      histogram_add(&stats->histograms[NUM_COMMANDS + STATS_LOCK_HOLD],
+                    stats_now() - stats->held[i - 1].acquired);
+      stats->held[i - 1] = stats->held[--stats->num_held];
+      break;
+    }
+  }
+}
+
+int stats_json(void) { return json; }
+
+FILE *stats_output_open(void) {
+  const char *path = getenv("EMS_STATS_FILE");
+  if (path == NULL || *path == '\0') {
+    return stderr;
+  }
+
+  FILE *out = fopen(path, "a");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return stderr;
+  }
+  return out;
+}
+
+void stats_output_close(FILE *out) {
+  if (out != stderr) {
+    fclose(out);
+  } else {
+    fflush(out);
+  }
+}
+
+void stats_thread_flush(void) {
+  struct ThreadStats *stats = local;
+  if (stats == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&totals_mutex);
+  for (size_t i = 0; i < NUM_HISTOGRAMS; i++) {
+    histogram_merge(&totals[i], &stats->histograms[i]);
+  }
+
+  // Threads are recreated after every barrier, so summaries are kept per id.
+  size_t i = 0;
+  while (i < num_summaries && summaries[i].thread_id != stats->thread_id) {
+    i++;
+  }
+  if (i == num_summaries) {
+    struct ThreadSummary *grown =
+        realloc(summaries, (num_summaries + 1) * sizeof(struct ThreadSummary));
+    if (grown != NULL) {
+      summaries = grown;
+      summaries[num_summaries++] =
+          (struct ThreadSummary){stats->thread_id, 0, 0};
+    }
+  }
+  if (i < num_summaries) {
+    summaries[i].commands += stats->commands;
+    summaries[i].busy_ns += stats->busy_ns;
+  }
+  pthread_mutex_unlock(&totals_mutex);
+
+  pthread_setspecific(stats_key, NULL);
+  free(stats);
+  local = NULL;
+}
+
+static void dump_histogram(FILE *out, const char *name,
+                           const struct Histogram *histogram, int first) {
+  uint64_t mean = histogram->count ? histogram->sum / histogram->count : 0;
+  if (json) {
+    fprintf(out,
+            "%s\n    \"%s\": {\"count\": %llu, \"mean_ns\": %llu, "
+            "\"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+            "\"p99_ns\": %llu, \"max_ns\": %llu}",
+            first ? "" : ",", name, (unsigned long long)histogram->count,
+            (unsigned long long)mean, (unsigned long long)histogram->min,
+            (unsigned long long)histogram_percentile(histogram, 50),
+            (unsigned long long)histogram_percentile(histogram, 90),
+            (unsigned long long)histogram_percentile(histogram, 99),
+            (unsigned long long)histogram->max);
+  } else {
+    fprintf(out,
+            "  %-10s count=%llu mean=%llu min=%llu p50=%llu p90=%llu "
+            "p99=%llu max=%llu\n",
+            name, (unsigned long long)histogram->count,
+            (unsigned long long)mean, (unsigned long long)histogram->min,
+            (unsigned long long)histogram_percentile(histogram, 50),
+            (unsigned long long)histogram_percentile(histogram, 90),
+            (unsigned long long)histogram_percentile(histogram, 99),
+            (unsigned long long)histogram->max);
+  }
+}
+
+void stats_dump(const char *label) {
+  if (!stats_enabled()) {
+    return;
+  }
+  stats_thread_flush();
+
+  FILE *out = stats_output_open();
+  pthread_mutex_lock(&totals_mutex);
+
+  // Every command, used to report the overall latency.
+  struct Histogram *all = calloc(1, sizeof(struct Histogram));
+  if (all != NULL) {
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+      histogram_merge(all, &totals[i]);
+    }
+  }
+
+  if (json) {
+    fprintf(out, "{\"file\": \"%s\", \"pid\": %d, \"latency\": {", label,
+            (int)getpid());
+  } else {
+    fprintf(out, "stats %s (pid %d), latencies in ns:\n", label, (int)getpid());
+  }
+
+  int first = 1;
+  if (all != NULL) {
+    dump_histogram(out, "total", all, first);
+    first = 0;
+  }
+  for (size_t i = 0; i < NUM_HISTOGRAMS; i++) {
+    if (totals[i].count == 0) {
+      continue;
+    }
+    const char *name = i < NUM_COMMANDS ? command_name((enum Command)i)
+                                        : metric_names[i - NUM_COMMANDS];
+    dump_histogram(out, name, &totals[i], first);
+    first = 0;
+  }
+
+  if (json) {
+    fprintf(out, "\n  },\n  \"threads\": [");
+  }
+  for (size_t i = 0; i < num_summaries; i++) {
+    if (json) {
+      fprintf(out, "%s{\"id\": %d, \"commands\": %llu, \"busy_ns\": %llu}",
+              i ? ", " : "", summaries[i].thread_id,
+              (unsigned long long)summaries[i].commands,
+              (unsigned long long)summaries[i].busy_ns);
+    } else {
+      fprintf(out, "  thread %d commands=%llu busy=%llu\n",
+              summaries[i].thread_id,
+              (unsigned long long)summaries[i].commands,
+              (unsigned long long)summaries[i].busy_ns);
+    }
+  }
+
+  // Peak resident set size of the process, to check that memory stays flat.
+  struct rusage usage;
+  long max_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+  if (json) {
+    fprintf(out, "],\n  \"max_rss_kb\": %ld}\n", max_rss_kb);
+  } else {
+    fprintf(out, "  memory max_rss_kb=%ld\n", max_rss_kb);
+  }
+
+  memset(totals, 0, sizeof(totals));
+  free(summaries);
+  summaries = NULL;
+  num_summaries = 0;
+  pthread_mutex_unlock(&totals_mutex);
+
+  free(all);
+  stats_output_close(out);
+}
+
+#endif // EMS_STATS
@@ -0,0 +1,108 @@
+#ifndef EMS_STATS_H
+#define EMS_STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "parser.h"
+
+/// Latency metrics tracked besides the per-command ones.
+enum StatsMetric {
+  STATS_PARSE,     // Lines parsed (and skipped) by threads that do not own them
+  STATS_LOCK_WAIT, // Time spent waiting to acquire a state mutex
+  STATS_LOCK_HOLD, // Time a state mutex was held
+  STATS_DELAY,     // Simulated state access delay
+  STATS_WRITE,     // Output writes
+  STATS_NUM_METRICS
+};
+
+#ifdef EMS_STATS
+
+/// Returns the current monotonic time in nanoseconds.
+uint64_t stats_now(void);
+
+/// Tells whether statistics are being collected (EMS_STATS is set).
+int stats_enabled(void);
+
+/// Sets the thread id reported for the calling thread.
+void stats_set_thread(int thread_id);
+
+/// Records the latency of a command started at the given time.
+/// @param cmd Command that was executed.
+/// @param owned 1 if the calling thread executed the command, 0 if it only
+/// parsed it.
+/// @param start Time returned by stats_now() before the command was read.
+void stats_record_command(enum Command cmd, int owned, uint64_t start);
+
+/// Records the time elapsed since start for the given metric.
+void stats_record(enum StatsMetric metric, uint64_t start);
+
+/// Sets the command the calling thread is executing.
+/// @param cmd Command being executed.
+/// @param line Line of the command in the job file.
+void stats_set_context(enum Command cmd, int line);
+
+/// Gets the command the calling thread is executing.
+void stats_get_context(int *cmd, int *line);
+
+/// Gets the name of a command.
+const char *stats_command_name(int cmd);
+
+/// Records that a lock was acquired after waiting since start.
+/// @param lock Lock that was acquired, used to match stats_lock_released.
+/// @param start Time returned by stats_now() before trying to acquire it.
+void stats_lock_acquired(const void *lock, uint64_t start);
+
+/// Records that a lock acquired with stats_lock_acquired was released.
+void stats_lock_released(const void *lock);
+
+/// Opens the statistics output: EMS_STATS_FILE if set, stderr otherwise.
+FILE *stats_output_open(void);
+
+/// Closes a statistics output opened with stats_output_open.
+void stats_output_close(FILE *out);
+
+/// Tells whether the statistics are written as JSON (EMS_STATS=json).
+int stats_json(void);
+
+/// Merges the calling thread's statistics into the process totals.
+/// @note Called automatically when a thread exits.
+void stats_thread_flush(void);
+
+/// Writes the process totals as text or JSON (EMS_STATS=json) to stderr, or
+/// to EMS_STATS_FILE if set, and resets them.
+/// @param label Name of the run, usually the job file.
+void stats_dump(const char *label);
+
+#define STATS_START(var) uint64_t var = stats_enabled() ? stats_now() : 0
+#define STATS_SET_THREAD(id) stats_set_thread(id)
+#define STATS_RECORD_COMMAND(cmd, owned, start)                                \
+  do {                                                                         \
+    if (stats_enabled())                                                       \
+      stats_record_command(cmd, owned, start);                                 \
+  } while (0)
+#define STATS_RECORD(metric, start)                                            \
+  do {                                                                         \
+    if (stats_enabled())                                                       \
+      stats_record(metric, start);                                             \
+  } while (0)
+#define STATS_SET_CONTEXT(cmd, line)                                           \
+  do {                                                                         \
+    if (stats_enabled())                                                       \
+      stats_set_context(cmd, line);                                            \
+  } while (0)
+#define STATS_DUMP(label) stats_dump(label)
+
+#else
+
+#define STATS_START(var)
+#define STATS_SET_THREAD(id)
+#define STATS_RECORD_COMMAND(cmd, owned, start)
+#define STATS_RECORD(metric, start)
+#define STATS_SET_CONTEXT(cmd, line)
+#define STATS_DUMP(label)
+
+#endif // EMS_STATS
+
+#endif // EMS_STATS_H
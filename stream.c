@@ -0,0 +1,224 @@
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aux.h"
+#include "collector.h"
+#include "constants.h"
+#include "operations.h"
+#include "stats.h"
+#include "trace.h"
+
+enum SlotState { SLOT_FREE, SLOT_READY, SLOT_RUNNING };
+
+/// A command of the stream, parsed in place by the reader.
+struct StreamSlot {
+  struct Request req;
+  int line;
+  enum SlotState state;
+};
+
+/// Commands read and not yet executed. The reader fills the slots in order
+/// and the workers take them in the same order, so the slot the reader fills
+/// next is free once the command read STREAM_QUEUE_SIZE commands earlier has
+/// run.
+struct StreamQueue {
+  struct StreamSlot slots[STREAM_QUEUE_SIZE];
+  size_t next_fill; /// Slot the reader fills next.
+  size_t next_take; /// Slot the workers take next.
+  int in_flight;    /// Commands read and not yet executed.
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready; /// Signaled when a command is queued or on stop.
+  pthread_cond_t freed; /// Broadcast when a command has run.
+};
+
+struct Worker {
+  pthread_t thread;
+  int id;
+};
+
+static struct StreamQueue queue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                                   .ready = PTHREAD_COND_INITIALIZER,
+                                   .freed = PTHREAD_COND_INITIALIZER};
+static struct OutputCollector *collector;
+static int stream_fd_out = -1;
+
+static void *run_worker(void *worker_args) {
+  struct Worker *worker = (struct Worker *)worker_args;
+  (void)worker; // Only used by the stats and trace hooks
+  STATS_SET_THREAD(worker->id);
+  TRACE_THREAD(worker->id);
+
+  pthread_mutex_lock(&queue.mutex);
+  while (1) {
+    struct StreamSlot *slot =
+        &queue.slots[queue.next_take % STREAM_QUEUE_SIZE];
+    if (slot->state != SLOT_READY) {
+      if (queue.stopping) {
+        break;
+      }
+      pthread_cond_wait(&queue.ready, &queue.mutex);
+      continue;
+    }
+    queue.next_take++;
+    slot->state = SLOT_RUNNING;
+    pthread_mutex_unlock(&queue.mutex);
+
+    STATS_START(start);
+    TRACE_START(trace_start);
+    STATS_SET_CONTEXT(slot->req.cmd, slot->line);
+    if (slot->req.cmd == CMD_HELP) {
+      // The help goes with the output of the stream, in line order.
+      char *help = strdup(HELP_TEXT);
+      collector_submit(collector, slot->line, help,
+                       help == NULL ? 0 : strlen(help));
+    } else {
+      execute_collected(&slot->req, slot->line, stream_fd_out, collector);
+    }
+    STATS_RECORD_COMMAND(slot->req.cmd, 1, start);
+    TRACE_COMPLETE(command_name(slot->req.cmd), trace_start, slot->line);
+
+    pthread_mutex_lock(&queue.mutex);
+    slot->state = SLOT_FREE;
+    queue.in_flight--;
+    pthread_cond_broadcast(&queue.freed);
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return NULL;
+}
+
+/// Waits until every queued command has run and writes their output.
+static void drain(void) {
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.in_flight > 0) {
+    pthread_cond_wait(&queue.freed, &queue.mutex);
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  collector_flush(collector);
+}
+
+/// Reads and dispatches the commands until the end of the stream.
+static void read_stream(int fd_in) {
+  int line = 0;
+  while (1) {
+    // Backpressure: wait for the slot of the oldest command to be free.
+    pthread_mutex_lock(&queue.mutex);
+    struct StreamSlot *slot =
+        &queue.slots[queue.next_fill % STREAM_QUEUE_SIZE];
+    while (slot->state != SLOT_FREE) {
+      pthread_cond_wait(&queue.freed, &queue.mutex);
+    }
+    pthread_mutex_unlock(&queue.mutex);
+
+    fflush(stdout);
+    enum Command cmd = read_request(fd_in, &line, &slot->req);
+    if (cmd == EOC) {
+      break;
+    }
+    if (cmd == CMD_BARRIER) {
+      TRACE_BEGIN("barrier");
+      drain();
+      TRACE_END("barrier");
+      line = 0;
+      continue;
+    }
+    if (cmd == CMD_WAIT) {
+      if (slot->req.delay > 0) {
+        // stdout usually carries the output of the stream.
+        fprintf(stderr, "Waiting...\n");
+        ems_wait(slot->req.delay);
+      }
+      collector_submit(collector, line, NULL, 0);
+    } else {
+      pthread_mutex_lock(&queue.mutex);
+      slot->line = line;
+      slot->state = SLOT_READY;
+      queue.next_fill++;
+      queue.in_flight++;
+      pthread_cond_signal(&queue.ready);
+      pthread_mutex_unlock(&queue.mutex);
+    }
+
+    // The line count starts over once in a while, as after a BARRIER, so
+    // that it never overflows.
+    if (line >= STREAM_MAX_LINES) {
+      drain();
+      line = 0;
+    }
+  }
+  drain();
+}
+
+int execute_stream(const char *path, int fd_out,
+                   unsigned int state_access_delay_ms, int num_workers) {
+  if (num_workers <= 0) {
+    fprintf(stderr, "Invalid number of workers\n");
+    return 1;
+  }
+
+  int fd_in = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd_in < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if (ems_init(state_access_delay_ms)) {
+    fprintf(stderr, "Failed to initialize EMS\n");
+    if (fd_in != STDIN_FILENO) {
+      close(fd_in);
+    }
+    return 1;
+  }
+
+  collector = collector_create(fd_out);
+  struct Worker *workers = malloc((size_t)num_workers * sizeof(struct Worker));
+  if (collector == NULL || workers == NULL) {
+    fprintf(stderr, "Error allocating memory for workers\n");
+    if (collector != NULL) {
+      collector_destroy(collector);
+    }
+    free(workers);
+    ems_terminate();
+    if (fd_in != STDIN_FILENO) {
+      close(fd_in);
+    }
+    return 1;
+  }
+  stream_fd_out = fd_out;
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+
+  read_stream(fd_in);
+
+  pthread_mutex_lock(&queue.mutex);
+  queue.stopping = 1;
+  pthread_cond_broadcast(&queue.ready);
+  pthread_mutex_unlock(&queue.mutex);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  free(workers);
+  for (size_t i = 0; i < STREAM_QUEUE_SIZE; i++) {
+    free_request(&queue.slots[i].req);
+  }
+
+  if (fd_in != STDIN_FILENO) {
+    close(fd_in);
+  }
+  collector_destroy(collector);
+  ems_terminate();
+  const char *label = fd_in == STDIN_FILENO ? "stdin" : path;
+  (void)label; // Only used by the stats and trace hooks
+  STATS_DUMP(label);
+  TRACE_FLUSH_JOB(label);
+  return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef EMS_STREAM_H
+#define EMS_STREAM_H
+
+/// Executes the commands of an unbounded stream, such as stdin or a FIFO.
+///
+/// A job file is read once per thread, which needs a regular file. A stream
+/// is instead read by the calling thread only, which parses every command
+/// into a queue of STREAM_QUEUE_SIZE slots for a pool of worker threads. The
+/// reader waits while the queue is full, so a fast producer is held back by
+/// the pipe and the memory used stays the same however long the stream runs.
+///
+/// The output is written in line order as soon as the lines before it have
+/// run, through an OutputCollector. As in a job file, the commands between two
+/// BARRIERs run concurrently, and a BARRIER waits for every command before
+/// it. A WAIT holds back the commands after it, whatever its thread_id.
+/// @param path Path of the stream, "-" for stdin.
+/// @param fd_out File descriptor to write the output to.
+/// @param state_access_delay_ms State access delay in milliseconds.
+/// @param num_workers Number of worker threads.
+/// @return 0 once the stream ended, 1 on failure.
+int execute_stream(const char *path, int fd_out,
+                   unsigned int state_access_delay_ms, int num_workers);
+
+#endif // EMS_STREAM_H
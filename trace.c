@@ -0,0 +1,224 @@
+#include "trace.h"
+
+#ifdef EMS_TRACE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+/// Events kept per thread, the oldest are overwritten when the ring is full.
+#define TRACE_RING_SIZE (1 << 14)
+
+struct TraceEvent {
+  uint64_t ts;      /// Start time in nanoseconds.
+  uint64_t dur;     /// Duration in nanoseconds, for complete events.
+  const char *name; /// Name of the event.
+  long arg;         /// Argument of the event.
+  char phase;       /// Chrome trace phase: 'X', 'B' or 'E'.
+};
+
+struct TraceRing {
+  int tid;
+  uint64_t barrier_ts; /// When the thread last reached a barrier, 0 if not.
+  size_t next;         /// Index of the next event to write.
+  size_t count;        /// Number of events in the ring.
+  struct TraceEvent events[TRACE_RING_SIZE];
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int enabled = 0;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing **rings = NULL;
+static size_t num_rings = 0;
+
+static _Thread_local struct TraceRing *current = NULL;
+
+static void trace_setup(void) {
+  const char *value = getenv("EMS_TRACE");
+  enabled = value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
+
+int trace_enabled(void) {
+  pthread_once(&trace_once, trace_setup);
+  return enabled;
+}
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void trace_thread(int tid) {
+  pthread_mutex_lock(&rings_mutex);
+  current = NULL;
+  for (size_t i = 0; i < num_rings; i++) {
+    if (rings[i]->tid == tid) {
+      current = rings[i];
+      break;
+    }
+  }
+
+  if (current == NULL) {
+    struct TraceRing **grown =
+        realloc(rings, (num_rings + 1) * sizeof(struct TraceRing *));
+    struct TraceRing *ring = calloc(1, sizeof(struct TraceRing));
+    if (grown != NULL) {
+      rings = grown;
+    }
+    if (grown == NULL || ring == NULL) {
+      fprintf(stderr, "Error allocating memory for trace\n");
+      free(ring);
+    } else {
+      ring->tid = tid;
+      rings[num_rings++] = ring;
+      current = ring;
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+}
+
+static void ring_push(struct TraceRing *ring, struct TraceEvent event) {
+  ring->events[ring->next] = event;
+  ring->next = (ring->next + 1) % TRACE_RING_SIZE;
+  if (ring->count < TRACE_RING_SIZE) {
+    ring->count++;
+  }
+}
+
+void trace_complete(const char *name, uint64_t start, long arg) {
+  if (current != NULL) {
+    ring_push(current,
+              (struct TraceEvent){start, trace_now() - start, name, arg, 'X'});
+  }
+}
+
+void trace_begin(const char *name) {
+  if (current != NULL) {
+    ring_push(current, (struct TraceEvent){trace_now(), 0, name, 0, 'B'});
+  }
+}
+
+void trace_end(const char *name) {
+  if (current != NULL) {
+    ring_push(current, (struct TraceEvent){trace_now(), 0, name, 0, 'E'});
+  }
+}
+
+void trace_barrier_arrive(void) {
+  if (trace_enabled() && current != NULL) {
+    current->barrier_ts = trace_now();
+  }
+}
+
+void trace_barrier_release(void) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  // Called once every thread has been joined, so the rings are not in use.
+  pthread_mutex_lock(&rings_mutex);
+  for (size_t i = 0; i < num_rings; i++) {
+    if (rings[i]->barrier_ts != 0) {
+      uint64_t start = rings[i]->barrier_ts;
+      ring_push(rings[i], (struct TraceEvent){start, trace_now() - start,
+                                              "BARRIER wait", 0, 'X'});
+      rings[i]->barrier_ts = 0;
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+}
+
+void trace_reset(void) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  pthread_mutex_lock(&rings_mutex);
+  for (size_t i = 0; i < num_rings; i++) {
+    free(rings[i]);
+  }
+  free(rings);
+  rings = NULL;
+  num_rings = 0;
+  current = NULL;
+  pthread_mutex_unlock(&rings_mutex);
+}
+
+void trace_flush(const char *path) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    trace_reset();
+    return;
+  }
+
+  int pid = (int)getpid();
+  int first = 1;
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+  pthread_mutex_lock(&rings_mutex);
+  for (size_t i = 0; i < num_rings; i++) {
+    struct TraceRing *ring = rings[i];
+    char thread_name[32] = "main";
+    if (ring->tid >= 0) {
+      snprintf(thread_name, sizeof(thread_name), "thread %d", ring->tid);
+    }
+    fprintf(out,
+            "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",", pid, ring->tid, thread_name);
+    first = 0;
+
+    size_t oldest = (ring->next + TRACE_RING_SIZE - ring->count) %
+                    TRACE_RING_SIZE;
+    for (size_t j = 0; j < ring->count; j++) {
+      struct TraceEvent *event = &ring->events[(oldest + j) % TRACE_RING_SIZE];
+      fprintf(out,
+              ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu.%03llu, "
+              "\"pid\": %d, \"tid\": %d",
+              event->name, event->phase,
+              (unsigned long long)(event->ts / 1000),
+              (unsigned long long)(event->ts % 1000), pid, ring->tid);
+      if (event->phase == 'X') {
+        fprintf(out, ", \"dur\": %llu.%03llu, \"args\": {\"arg\": %ld}",
+                (unsigned long long)(event->dur / 1000),
+                (unsigned long long)(event->dur % 1000), event->arg);
+      }
+      fprintf(out, "}");
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  fprintf(out, "\n]}\n");
+  fclose(out);
+  trace_reset();
+}
+
+void trace_flush_job(const char *filein) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  char path[1024];
+  size_t len = strlen(filein);
+  size_t ext_len = strlen(INPUT_EXTENSION);
+  if (len >= ext_len && strcmp(filein + len - ext_len, INPUT_EXTENSION) == 0) {
+    len -= ext_len;
+  }
+  snprintf(path, sizeof(path), "%.*s.trace.json", (int)len, filein);
+  trace_flush(path);
+}
+
+#endif // EMS_TRACE
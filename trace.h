@@ -0,0 +1,91 @@
+#ifndef EMS_TRACE_H
+#define EMS_TRACE_H
+
+#include <stdint.h>
+
+#ifdef EMS_TRACE
+
+/// Tells whether tracing is enabled (EMS_TRACE is set).
+int trace_enabled(void);
+
+/// Returns the current monotonic time in nanoseconds.
+uint64_t trace_now(void);
+
+/// Attaches the calling thread to the trace ring of the given thread id,
+/// creating it on first use. Rings outlive threads, so the threads recreated
+/// after a barrier keep appending to the same ring.
+/// @param tid Thread id, -1 for the main thread.
+void trace_thread(int tid);
+
+/// Records a span that started at start and ends now.
+/// @param name Name of the span, must be a string literal.
+/// @param start Time returned by trace_now() at the start of the span.
+/// @param arg Argument shown with the span, usually a line or event id.
+void trace_complete(const char *name, uint64_t start, long arg);
+
+/// Opens a span that is closed by trace_end.
+void trace_begin(const char *name);
+
+/// Closes the last span opened with trace_begin.
+void trace_end(const char *name);
+
+/// Records that the calling thread reached a barrier.
+void trace_barrier_arrive(void);
+
+/// Records, on every ring, the wait from reaching the barrier until now.
+void trace_barrier_release(void);
+
+/// Drops the rings inherited from the parent after a fork.
+void trace_reset(void);
+
+/// Writes every ring as Chrome trace JSON and frees them.
+/// @param path Path of the trace file.
+void trace_flush(const char *path);
+
+/// Writes the trace of a job file next to it, as <job>.trace.json.
+/// @param filein Path of the job file.
+void trace_flush_job(const char *filein);
+
+#define TRACE_START(var) uint64_t var = trace_enabled() ? trace_now() : 0
+#define TRACE_THREAD(tid)                                                      \
+  do {                                                                         \
+    if (trace_enabled())                                                       \
+      trace_thread(tid);                                                       \
+  } while (0)
+#define TRACE_COMPLETE(name, start, arg)                                       \
+  do {                                                                         \
+    if (trace_enabled())                                                       \
+      trace_complete(name, start, (long)(arg));                                \
+  } while (0)
+#define TRACE_BEGIN(name)                                                      \
+  do {                                                                         \
+    if (trace_enabled())                                                       \
+      trace_begin(name);                                                       \
+  } while (0)
+#define TRACE_END(name)                                                        \
+  do {                                                                         \
+    if (trace_enabled())                                                       \
+      trace_end(name);                                                         \
+  } while (0)
+#define TRACE_BARRIER_ARRIVE() trace_barrier_arrive()
+#define TRACE_BARRIER_RELEASE() trace_barrier_release()
+#define TRACE_RESET() trace_reset()
+#define TRACE_FLUSH(path) trace_flush(path)
+#define TRACE_FLUSH_JOB(filein) trace_flush_job(filein)
+
+#else
+
+#define TRACE_START(var)
+#define TRACE_THREAD(tid)
+#define TRACE_COMPLETE(name, start, arg)
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_BARRIER_ARRIVE()
+#define TRACE_BARRIER_RELEASE()
+#define TRACE_RESET()
+#define TRACE_FLUSH(path)
+#define TRACE_FLUSH_JOB(filein)
+
+#endif // EMS_TRACE
+
+#endif // EMS_TRACE_H